@@ -9,10 +9,48 @@ using namespace seqan;
 struct Parameters
 {
     CharString bamFileName;
-    CharString bcWlFileName;
+    String<CharString> bamFileNames;
+    bool sorted;
+    String<CharString> bcWlFileNames;
+    String<CharString> bcExcludeFileNames;
+    bool requireAllLists;
+    bool bloom;
     CharString outBamFileName;
+    CharString outputFormat;
     unsigned trimming;
     CharString bctag;
+    unsigned threads;
+    unsigned minMapq;
+    CharString requireFlags;
+    CharString excludeFlags;
+    CharString filterExpr;
+    bool mateConsistent;
+    unsigned mateWindow;
+    CharString regionsFileName;
+    CharString fastqR2FileName;
+    CharString fastqSingletonFileName;
+    bool splitFastq;
+    CharString split;
+    CharString keepTags;
+    CharString dropTags;
+    String<CharString> addTags;
+    CharString labelTag;
+    bool countOnly;
+    bool flagstat;
+    bool checksum;
+    unsigned sampleBlocks;
+    CharString dedup;
+    CharString umiTag;
+    unsigned readsPerBarcode;
+    CharString sampleOrder;
+    unsigned sampleMemory;
+    unsigned sampleSeed;
+};
+
+struct ConcatParameters
+{
+    String<CharString> bamFileNames;
+    CharString outBamFileName;
 };
 
 ArgumentParser::ParseResult parseCommandLine(Parameters & params, int argc, char const ** argv)
@@ -23,23 +61,67 @@ ArgumentParser::ParseResult parseCommandLine(Parameters & params, int argc, char
     setShortDescription(parser, "Create a BAM file subset based on barcode whitelist");
     setVersion(parser, VERSION);
     setDate(parser, DATE);
-    addUsageLine(parser, "\\fI-w BARCODE-FILE\\fP \\fI-o OUTPUT-FILE\\fP \\fI[OPTIONS]\\fP \\fIBAM-FILE\\fP");
+    addUsageLine(parser, "\\fI-w BARCODE-FILE\\fP [\\fI-w BARCODE-FILE\\fP ...] [\\fI-x BARCODE-FILE\\fP ...] \\fI-o OUTPUT-FILE\\fP \\fI[OPTIONS]\\fP \\fIBAM-FILE\\fP [\\fIBAM-FILE\\fP ...]");
 
     addDescription(parser, "Selects records from the BAM file that match the barcodes provided in a whitelist.");
+    addDescription(parser, "Several BAM files with compatible references, e.g. the lanes of a library, are subset into "
+                   "one output. Their headers are merged and each file is filtered before the records are merged.");
+    addDescription(parser, "The outputs of runs on the parts of a BAM file given by --split are joined by "
+                   "\\fIbcsubset concat -o OUTPUT-FILE BAM-FILE ...\\fP.");
 
     // Input BAM file
     addArgument(parser, ArgParseArgument(
-        ArgParseArgument::STRING, "BAMFILE"));
+        ArgParseArgument::STRING, "BAMFILE", true));
     // Whitelisted barcodes ile
     addOption(parser, ArgParseOption(
-        "w", "whitelist", "File containing whitelisted barcodes. One barcode per line.",
-        ArgParseArgument::INPUT_FILE, "FILE"));
-    setRequired(parser, "w");
+        "w", "whitelist", "File containing whitelisted barcodes. One barcode per line, optionally followed by a label "
+        "like a sample name, separated by whitespace or a comma. "
+        "If given multiple times, barcodes in any of the files are whitelisted.",
+        ArgParseArgument::INPUT_FILE, "FILE", true));
+    // Excluded barcodes files
+    addOption(parser, ArgParseOption(
+        "x", "exclude", "File containing barcodes to exclude, e.g. doublets. One barcode per line. "
+        "Can be given multiple times. Without -w, all other barcodes are kept.",
+        ArgParseArgument::INPUT_FILE, "FILE", true));
+    addOption(parser, ArgParseOption(
+        "", "require_all", "Only keep barcodes contained in all files given by -w."));
+    addOption(parser, ArgParseOption(
+        "", "bloom", "Check the barcodes against a Bloom filter of the barcode lists first. Pays off for large "
+        "lists if most barcodes of the input are not in them. The rejection rate is reported in the summary."));
     // Out BAM file name
     addOption(parser, ArgParseOption(
         "o", "out", "Output name for barcode subset BAM file.",
         ArgParseArgument::OUTPUT_FILE, "FILE"));
     setRequired(parser, "o");
+    addOption(parser, ArgParseOption(
+        "", "output_fmt", "Format of the output file. SAM and FASTQ output is compressed if the output file name ends in .gz. "
+        "Default: by the extension of the output file name (.sam, .fastq, .fq, optionally followed by .gz), bam otherwise.",
+        ArgParseArgument::STRING, "FORMAT"));
+    setValidValues(parser, "output_fmt", "bam sam fastq");
+    addOption(parser, ArgParseOption(
+        "", "fastq_r2", "With FASTQ output, write read 2 of paired reads to this file and read 1 to the output file. "
+        "Otherwise paired reads are interleaved.",
+        ArgParseArgument::OUTPUT_FILE, "FILE"));
+    addOption(parser, ArgParseOption(
+        "", "fastq_singletons", "With FASTQ output, write unpaired reads and reads whose mate is not written to this "
+        "file. Otherwise they are skipped, except for unpaired reads in interleaved output.",
+        ArgParseArgument::OUTPUT_FILE, "FILE"));
+    addOption(parser, ArgParseOption(
+        "", "split_fastq", "With FASTQ output, write one file (pair) per barcode list given by -w, named by inserting "
+        "the list name before the extension."));
+    addOption(parser, ArgParseOption(
+        "", "count_only", "Only count the records instead of writing them. The output file lists the passed records "
+        "per barcode."));
+    addOption(parser, ArgParseOption(
+        "", "sample_blocks", "With --count_only, only read the records of every k-th compressed block of the BAM file "
+        "and estimate the counts of the whole file from them.",
+        ArgParseArgument::INTEGER, "K"));
+    addOption(parser, ArgParseOption(
+        "", "flagstat", "Count the written records like samtools flagstat and idxstats, written to OUT.flagstat, "
+        "OUT.flagstat.json and OUT.idxstats."));
+    addOption(parser, ArgParseOption(
+        "", "checksum", "Compute the MD5 of the output files while writing them, and a checksum of the written records "
+        "that does not depend on their order. Both are reported in the summary."));
     // Trimming barcode
     addOption(parser, ArgParseOption(
         "t", "trim_suffix", "Trim the last n characters from barcode in input BAM file.",
@@ -48,9 +130,102 @@ ArgumentParser::ParseResult parseCommandLine(Parameters & params, int argc, char
     //setMinValue(parser, "t", 0); // line that breaks the help
     // Specify tag for barcode
     addOption(parser, ArgParseOption(
-        "b", "barcode_tag", "BAM record tag containing the barcodes to compare with the whitelist.",
+        "b", "barcode_tag", "BAM record tag containing the barcodes to compare with the whitelist. "
+        "Fallback tags are separated by comma (CB,CR), tags combined into one key by plus (BC+CB). "
+        "Append :NUM to a tag to override the trimming for it (CB,CR:0).",
         ArgParseArgument::STRING, "TAG"));
     addDefaultValue(parser, "b", "CB");
+    // Number of filter threads
+    addOption(parser, ArgParseOption(
+        "p", "threads", "Number of threads filtering records and loading the barcode lists. "
+        "Compression uses additional threads.",
+        ArgParseArgument::INTEGER, "NUM"));
+    addDefaultValue(parser, "p", 1);
+    // Record filters applied in addition to the barcode whitelist
+    addOption(parser, ArgParseOption(
+        "q", "min_mapq", "Only keep records with mapping quality at least NUM.",
+        ArgParseArgument::INTEGER, "NUM"));
+    addDefaultValue(parser, "q", 0);
+    addOption(parser, ArgParseOption(
+        "f", "require_flags", "Only keep records with all bits of the FLAG mask set (decimal or 0x hex).",
+        ArgParseArgument::STRING, "FLAG"));
+    addDefaultValue(parser, "f", "0");
+    addOption(parser, ArgParseOption(
+        "F", "exclude_flags", "Only keep records with none of the bits of the FLAG mask set (decimal or 0x hex).",
+        ArgParseArgument::STRING, "FLAG"));
+    addDefaultValue(parser, "F", "0");
+    addOption(parser, ArgParseOption(
+        "e", "expr", "Only keep records matching the filter expression, terms joined by &&, e.g. "
+        "\'mapq >= 30 && !flag & 0x904 && rname in chr1,chr2 && [xf] == 25 && qname ~ A00*\'. "
+        "Terms compare flag, mapq, pos, tlen or qlen with a number, test flag bits (flag & MASK), "
+        "contigs (rname in LIST), tag presence ([XX]) and values ([XX] == VALUE), or match qname against a glob pattern.",
+        ArgParseArgument::STRING, "EXPR"));
+    // Tags of the written records
+    addOption(parser, ArgParseOption(
+        "", "keep_tags", "Only write the listed tags of the records, separated by commas (CB,UB,RG).",
+        ArgParseArgument::STRING, "TAGS"));
+    addOption(parser, ArgParseOption(
+        "", "drop_tags", "Remove the listed tags from the records, separated by commas.",
+        ArgParseArgument::STRING, "TAGS"));
+    addOption(parser, ArgParseOption(
+        "", "add_tag", "Add a tag to each written record, e.g. SM:Z:sample1, replacing a tag with the same key. "
+        "Can be given multiple times.",
+        ArgParseArgument::STRING, "KEY:TYPE:VALUE", true));
+    addOption(parser, ArgParseOption(
+        "", "label_tag", "Tag of the written records holding the label of their barcode, given in a second column "
+        "of the whitelist.",
+        ArgParseArgument::STRING, "TAG"));
+    addDefaultValue(parser, "label_tag", "sm");
+    // Duplicates
+    addOption(parser, ArgParseOption(
+        "", "dedup", "Mark or remove the passed records with the same reference, unclipped 5' position, strand, barcode "
+        "and UMI as a passed record before them. Needs an input sorted by coordinate.",
+        ArgParseArgument::STRING, "MODE"));
+    setValidValues(parser, "dedup", "mark remove");
+    addOption(parser, ArgParseOption(
+        "", "umi_tag", "Tag holding the UMI of a record for --dedup.",
+        ArgParseArgument::STRING, "TAG"));
+    addDefaultValue(parser, "umi_tag", "UB");
+    // Sampling per barcode
+    addOption(parser, ArgParseOption(
+        "", "reads_per_barcode", "Write a uniform sample of at most K passed records per barcode.",
+        ArgParseArgument::INTEGER, "K"));
+    addOption(parser, ArgParseOption(
+        "", "sample_order", "Order of the sampled records: as in the input, or grouped by barcode.",
+        ArgParseArgument::STRING, "ORDER"));
+    setValidValues(parser, "sample_order", "input barcode");
+    addDefaultValue(parser, "sample_order", "input");
+    addOption(parser, ArgParseOption(
+        "", "sample_memory", "Megabytes of sampled records held in memory before they are spilled to temporary files.",
+        ArgParseArgument::INTEGER, "MB"));
+    addDefaultValue(parser, "sample_memory", 1024);
+    addOption(parser, ArgParseOption(
+        "", "sample_seed", "Seed of the random choice of the sampled records.",
+        ArgParseArgument::INTEGER, "NUM"));
+    addDefaultValue(parser, "sample_seed", 0);
+    // Mate-consistent filtering
+    addOption(parser, ArgParseOption(
+        "m", "mate_consistent", "Keep or drop all records with the same read name together, decided by the first of them "
+        "carrying a barcode. Filters given by -q, -f, -F and -e still apply to each record."));
+    addOption(parser, ArgParseOption(
+        "", "mate_window", "With -m, number of records to wait for the barcode of a read before its records are "
+        "moved to a temporary file and written at the end. Not used for inputs grouped by read name.",
+        ArgParseArgument::INTEGER, "NUM"));
+    addDefaultValue(parser, "mate_window", 1000000);
+    // Regions
+    addOption(parser, ArgParseOption(
+        "", "regions", "Only keep records overlapping the regions of the BED file. If the BAM file is indexed "
+        "(BAMFILE.bai), only the records near the regions are read.",
+        ArgParseArgument::INPUT_FILE, "FILE"));
+    // Several inputs
+    addOption(parser, ArgParseOption(
+        "", "sorted", "The BAM files are sorted by coordinate, with their shared references in the same order, "
+        "and the output is merged by coordinate. Otherwise, batches of records of the BAM files are written in turns."));
+    // Part of the input
+    addOption(parser, ArgParseOption(
+        "", "split", "Only process part N of M parts of the BAM file (0 <= N < M), for running M processes on one "
+        "unindexed BAM file. The parts are split at equal byte offsets and joined by bcsubset concat.",
+        ArgParseArgument::STRING, "N/M"));
     
     // Parse command line.
     ArgumentParser::ParseResult res = parse(parser, argc, argv);
@@ -61,19 +236,140 @@ ArgumentParser::ParseResult parseCommandLine(Parameters & params, int argc, char
         return res;
 
     // Extract option values
-    getArgumentValue(params.bamFileName, parser, 0);
+    for (unsigned i = 0; i < getArgumentValueCount(parser, 0); ++i)
+    {
+        CharString fileName;
+        getArgumentValue(fileName, parser, 0, i);
+        appendValue(params.bamFileNames, fileName);
+    }
+    params.bamFileName = params.bamFileNames[0];
+    params.sorted = isSet(parser, "sorted");
+
+    for (unsigned i = 0; i < getOptionValueCount(parser, "whitelist"); ++i)
+    {
+        CharString fileName;
+        getOptionValue(fileName, parser, "whitelist", i);
+        appendValue(params.bcWlFileNames, fileName);
+    }
+
+    for (unsigned i = 0; i < getOptionValueCount(parser, "exclude"); ++i)
+    {
+        CharString fileName;
+        getOptionValue(fileName, parser, "exclude", i);
+        appendValue(params.bcExcludeFileNames, fileName);
+    }
 
-    getOptionValue(params.bcWlFileName, parser, "whitelist");
+    params.requireAllLists = isSet(parser, "require_all");
+
+    params.bloom = isSet(parser, "bloom");
 
     getOptionValue(params.outBamFileName, parser, "out");
 
+    getOptionValue(params.outputFormat, parser, "output_fmt");
+
+    getOptionValue(params.fastqR2FileName, parser, "fastq_r2");
+    getOptionValue(params.fastqSingletonFileName, parser, "fastq_singletons");
+
+    params.splitFastq = isSet(parser, "split_fastq");
+
+    params.countOnly = isSet(parser, "count_only");
+
+    params.flagstat = isSet(parser, "flagstat");
+
+    params.checksum = isSet(parser, "checksum");
+
+    params.sampleBlocks = 0;
+    getOptionValue(params.sampleBlocks, parser, "sample_blocks");
+
     getOptionValue(params.trimming, parser, "trim_suffix");
 
     getOptionValue(params.bctag, parser, "barcode_tag");
+
+    getOptionValue(params.threads, parser, "threads");
+
+    getOptionValue(params.minMapq, parser, "min_mapq");
+
+    getOptionValue(params.requireFlags, parser, "require_flags");
+
+    getOptionValue(params.excludeFlags, parser, "exclude_flags");
+
+    getOptionValue(params.filterExpr, parser, "expr");
+
+    getOptionValue(params.keepTags, parser, "keep_tags");
+
+    getOptionValue(params.dropTags, parser, "drop_tags");
+
+    for (unsigned i = 0; i < getOptionValueCount(parser, "add_tag"); ++i)
+    {
+        CharString tag;
+        getOptionValue(tag, parser, "add_tag", i);
+        appendValue(params.addTags, tag);
+    }
+    getOptionValue(params.labelTag, parser, "label_tag");
+
+    getOptionValue(params.dedup, parser, "dedup");
+
+    getOptionValue(params.umiTag, parser, "umi_tag");
+
+    params.readsPerBarcode = 0;
+    getOptionValue(params.readsPerBarcode, parser, "reads_per_barcode");
+
+    getOptionValue(params.sampleOrder, parser, "sample_order");
+
+    getOptionValue(params.sampleMemory, parser, "sample_memory");
+
+    getOptionValue(params.sampleSeed, parser, "sample_seed");
+
+    params.mateConsistent = isSet(parser, "mate_consistent");
+
+    getOptionValue(params.mateWindow, parser, "mate_window");
+
+    getOptionValue(params.regionsFileName, parser, "regions");
+
+    getOptionValue(params.split, parser, "split");
     
     return ArgumentParser::PARSE_OK;
 }
 
+ArgumentParser::ParseResult parseConcatCommandLine(ConcatParameters & params, int argc, char const ** argv)
+{
+    ArgumentParser parser("bcsubset concat");
+
+    setShortDescription(parser, "Join BAM files without recompressing them");
+    setVersion(parser, VERSION);
+    setDate(parser, DATE);
+    addUsageLine(parser, "\\fI-o OUTPUT-FILE\\fP \\fIBAM-FILE\\fP [\\fIBAM-FILE\\fP ...]");
+
+    addDescription(parser, "Writes the records of the BAM files one after the other, e.g. the outputs of bcsubset "
+                   "--split runs in the order of their parts. The header is the one of the first file, with the "
+                   "references and read groups of the other files added. References in several files must have "
+                   "the same length.");
+    addDescription(parser, "The compressed blocks of the files are copied. Only the records in the blocks of the "
+                   "headers and blocks with records whose reference IDs differ in the output are compressed again.");
+
+    addArgument(parser, ArgParseArgument(
+        ArgParseArgument::INPUT_FILE, "BAMFILE", true));
+    addOption(parser, ArgParseOption(
+        "o", "out", "Output BAM file.",
+        ArgParseArgument::OUTPUT_FILE, "FILE"));
+    setRequired(parser, "o");
+
+    ArgumentParser::ParseResult res = parse(parser, argc, argv);
+    if (res != ArgumentParser::PARSE_OK)
+        return res;
+
+    for (unsigned i = 0; i < getArgumentValueCount(parser, 0); ++i)
+    {
+        CharString fileName;
+        getArgumentValue(fileName, parser, 0, i);
+        appendValue(params.bamFileNames, fileName);
+    }
+
+    getOptionValue(params.outBamFileName, parser, "out");
+
+    return ArgumentParser::PARSE_OK;
+}
+
 inline int checkParser(const ArgumentParser::ParseResult & res)
 {
     if (res == ArgumentParser::PARSE_HELP ||
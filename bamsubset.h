@@ -5,51 +5,66 @@
 #include <seqan/sequence.h>
 #include <seqan/bam_io.h>
 #include <iostream>
-#include <unordered_set>
+#include "pairs.h"
+#include "pipeline.h"
+#include "predicate.h"
+#include "output.h"
+#include "samparse.h"
+#include "tagedit.h"
+#include "whitelist.h"
 
 using namespace seqan;
 
-struct Stats
+// Compile the record filters given on the command line into a predicate
+// With filterRegions, records must overlap predicate.regions
+inline bool compileFilters(RecordPredicate & predicate, const unsigned minMapq, const CharString & requireFlags,
+                           const CharString & excludeFlags, const CharString & filterExpr, const bool filterRegions,
+                           StringSet<CharString> const & contigNames)
 {
-    unsigned filteredReads;
-    unsigned passedReads;
-
-    Stats(): filteredReads(0), passedReads(0){}
-
-    inline void report()
+    int64_t required, excluded;
+    if (!parseInteger(required, toCString(requireFlags)))
     {
-        std::cout << "\nSUMMARY" << std::endl;
-        std::cout << "Total records:\t\t" << (filteredReads + passedReads) << std::endl;
-        std::cout << "Filtered records:\t" << filteredReads << "\t(" << static_cast<double>(filteredReads)/(filteredReads + passedReads)*100 << "%)" 
-                    << "\nPassed records:\t\t" << passedReads << "\t(" << static_cast<double>(passedReads)/(filteredReads + passedReads)*100 << "%)" << std::endl;
+        std::cerr << "ERROR: Invalid flag mask '" << requireFlags << "'.\n";
+        return false;
     }
-};  
-
-//Read a text file containing whitelisted barcodes, put into set of strings
-//Return false if text file can not be opened
-//Return true if success
-bool readWhitelist(std::unordered_set<std::string> & wlBarcodes, const CharString & bcWlFileName)
-{
-    // Read whitelisted barcodes file
-    std::ifstream wlIn(toCString(bcWlFileName));
-
-    if (!wlIn.is_open())
+    if (!parseInteger(excluded, toCString(excludeFlags)))
     {
-        std::cerr << "ERROR: Could not open " << bcWlFileName << " for reading.\n";
+        std::cerr << "ERROR: Invalid flag mask '" << excludeFlags << "'.\n";
         return false;
     }
 
-    std::string barcode;
-    
-    while (wlIn >> barcode)
+    PredicateOp op = PredicateOp();
+    if (minMapq != 0)
     {
-        // Read the file line by line, save each barcode
-        wlBarcodes.emplace(barcode);
+        op.code = PRED_FIELD;
+        op.field = FIELD_MAPQ;
+        op.cmp = CMP_GE;
+        op.value = minMapq;
+        predicate.ops.push_back(op);
     }
-
-    std::cout << "\n[bcsubset] Loaded " << wlBarcodes.size() << " barcodes from \'" << bcWlFileName << "\'." << std::endl;
-
-    return !empty(wlBarcodes);
+    if (required != 0)
+    {
+        op.code = PRED_FLAG_ALL;
+        op.value = required;
+        predicate.ops.push_back(op);
+    }
+    if (excluded != 0)
+    {
+        op.code = PRED_FLAG_ANY;
+        op.negate = true;
+        op.value = excluded;
+        predicate.ops.push_back(op);
+    }
+    if (filterRegions)
+    {
+        op = PredicateOp();
+        op.code = PRED_REGION;
+        predicate.ops.push_back(op);
+    }
+    if (!empty(filterExpr) && !compileExpression(predicate, toCString(filterExpr), contigNames))
+        return false;
+    finalizePredicate(predicate);
+    return true;
 }
 
 // Process BAM header, add @PG line
@@ -80,71 +95,183 @@ inline void processHeader(BamHeader & header, BamFileOut & bamFileOut, char cons
     writeHeader(bamFileOut, header);
 }
 
-//Trim the last n characters of barcode
-inline void trimBarcode(CharString & barcode, const unsigned toTrim)
+// Look up the barcode of a BAM record in the whitelist, in order with the cursor of an input sorted by barcode
+// Otherwise the Bloom filter of the whitelist is checked first if it was built, counting its rejections in stats
+// With groups, also set the output group of the barcode
+// label is set to the ID of the whitelist label of a whitelisted barcode, 0 otherwise
+// With slots, also set the whitelist slot and the hash of the barcode, taking one more probe of the table
+inline BarcodeStatus getBarcodeStatus(RawRecord & record, const Whitelist & wlBarcodes, const BarcodeSpec & bcSpec,
+                                      const bool groups, const bool slots, SortedCursor * cursor, Stats & stats,
+                                      uint16_t & label)
 {
-    resize(barcode, length(barcode) - toTrim);
-}
-
-// Get barcode from tags in BAM records
-inline bool getBarcodeFromTags(std::string & barcode, const BamAlignmentRecord & record, const CharString & bctag, const unsigned toTrim)
-{
-    unsigned idx = 0;
+    label = 0;
+    if (slots)
+    {
+        record.slot = NO_SLOT;
+        record.barcodeHash = 0;
+    }
+    BarcodeKey key;
+    if(!getBarcodeKey(key, record, bcSpec))
+        return BARCODE_MISSING;
 
-    BamTagsDict tagsDict(record.tags);
-    bool keyFound = findTagKey(idx, tagsDict, bctag);
-    if (keyFound)
+    uint32_t lists;
+    if (cursor != NULL)
+    {
+        lists = sortedBarcodeLists(wlBarcodes, *cursor, key.begin[0], key.end[0] - key.begin[0], label);
+    }
+    else if (!empty(wlBarcodes.bloom))
     {
-        CharString tag;
-        if (!extractTagValue(tag, tagsDict, idx))
+        ++stats.bloomLookups;
+        if (mayContainBarcode(wlBarcodes, key))
         {
-        std::cerr << "WARNING: There was an error extracting barcode from tag " << bctag << " of record: " << record.qName << "\n";
-        return false;
+            lists = barcodeLists(wlBarcodes, key, label);
         }
         else
         {
-        trimBarcode(tag, toTrim);
-        move(barcode, tag);
-        return true;
+            ++stats.bloomRejected;
+            lists = 0;
         }
     }
     else
     {
-        return false;
-  }
+        lists = barcodeLists(wlBarcodes, key, label);
+    }
+    if (groups)
+        record.group = barcodeGroup(wlBarcodes, lists);
+    if (slots)
+    {
+        uint64_t hash = hashKey(key);
+        record.barcodeHash = hash | 1;
+        int64_t slot = (lists == 0) ? -1 : findBarcode(wlBarcodes, key, hash);
+        if (slot >= 0)
+            record.slot = slot;
+    }
+    if (!passesLists(wlBarcodes, lists))
+    {
+        label = 0;
+        return BARCODE_REJECTED;
+    }
+    return BARCODE_WHITELISTED;
 }
 
-// Check if a BAM record contains a whitelisted barcode
-inline bool isGoodRecord(const BamAlignmentRecord & record, const std::unordered_set<std::string> & wlBarcodes, const CharString & bctag, const unsigned toTrim)
+inline BarcodeStatus getBarcodeStatus(const RawRecord & record, const Whitelist & wlBarcodes, const BarcodeSpec & bcSpec)
 {
-    std::string readBC;
-    if(!getBarcodeFromTags(readBC, record, bctag, toTrim))
-        return false;
+    BarcodeKey key;
+    if(!getBarcodeKey(key, record, bcSpec))
+        return BARCODE_MISSING;
 
-    if (wlBarcodes.find(readBC) == wlBarcodes.end())
-        return false;
-    else
-        return true;
+    return isWhitelisted(wlBarcodes, key) ? BARCODE_WHITELISTED : BARCODE_REJECTED;
 }
 
-// Process input BAM file to find records matching the whitelisted barcodes and write them to output BAM file
-inline void processBam(BamFileIn & inFile, BamFileOut & bamFileOut, const std::unordered_set<std::string> & wlBarcodes, const CharString & bctag, const unsigned toTrim, Stats & stats)
+// Check if a BAM record contains a whitelisted barcode
+inline bool isGoodRecord(const RawRecord & record, const Whitelist & wlBarcodes, const BarcodeSpec & bcSpec)
 {
-    while (!atEnd(inFile))
-    {
-        BamAlignmentRecord record;
-        readRecord(record, inFile);
+    return getBarcodeStatus(record, wlBarcodes, bcSpec) == BARCODE_WHITELISTED;
+}
 
-        if(isGoodRecord(record, wlBarcodes, bctag, toTrim))
-        {
-            writeRecord(bamFileOut, record);
-            ++stats.passedReads;
-        }
-        else
+// Marks the records of a batch that pass the record predicate and carry a whitelisted barcode.
+// With mateConsistent, keep only reflects the predicate and the barcode is resolved per qName later.
+// For SAM input, the lines of the batch are parsed into raw records first.
+// With groups, the output group of each barcode is set as well.
+// With barcodeSorted, the barcodes are looked up in order in the sorted whitelist.
+// With duplicates or sample, the barcode and UMI of the kept records are identified and the records are hashed
+// before their tags are edited.
+struct BarcodeFilter
+{
+    const Whitelist & wlBarcodes;
+    const BarcodeSpec & bcSpec;
+    const RecordPredicate & predicate;
+    bool mateConsistent;
+    const SamParser * samParser;
+    bool groups;
+    bool barcodeSorted;
+    const TagEdits & tagEdits;
+    const DuplicateMarker * duplicates;
+    const ReservoirSample * sample;
+
+    void operator()(RecordBatch & batch) const
+    {
+        if (samParser != NULL)
+            parseSamBatch(batch, *samParser);
+        SortedCursor sortedCursor;
+        SortedCursor * cursor = barcodeSorted ? &sortedCursor : NULL;
+        bool edit = !empty(tagEdits);
+        bool slots = duplicates != NULL || sample != NULL;
+        for (RawRecord & rec : batch.records)
         {
-            ++stats.filteredReads;
+            uint16_t label = 0;
+            if (mateConsistent)
+            {
+                rec.keep = matchesPredicate(predicate, rec);
+                rec.barcode = getBarcodeStatus(rec, wlBarcodes, bcSpec, groups, slots, cursor, batch.stats, label);
+            }
+            else
+            {
+                rec.keep = matchesPredicate(predicate, rec) &&
+                           getBarcodeStatus(rec, wlBarcodes, bcSpec, groups, slots, cursor, batch.stats, label) ==
+                           BARCODE_WHITELISTED;
+                if (rec.keep)
+                    ++batch.stats.passedReads;
+                else
+                    ++batch.stats.filteredReads;
+            }
+            if (rec.keep && duplicates != NULL)
+                rec.umiHash = umiHash(*duplicates, rec);
+            if (rec.keep && sample != NULL)
+                rec.priority = hashBytes(rec.data, rec.length, sample->seed);
+            // The tags are edited after the barcode lookup, which may read a dropped tag.
+            // With mateConsistent, only records with a whitelisted barcode of their own are labelled.
+            if (edit && rec.keep)
+                editTags(rec, batch.arena, tagEdits, label);
         }
+        batch.stats.unsortedBarcodes += sortedCursor.unsorted;
+    }
+};
+
+// Process input BAM file to find records matching the whitelisted barcodes and write them to the output
+// If the filter is mate consistent, records are resolved per qName within mateWindow records
+// SAM and FASTQ text is formatted, the flags are counted and the records are hashed by the filter threads, except for
+// mate consistent filtering, duplicate marking and sampling where the writer does this. The writer pairs FASTQ reads
+// and counts them once written.
+template <typename TReader, typename TFilter>
+inline void processBam(TReader & reader, RecordOutput & output, const TFilter & filter,
+                       const unsigned numThreads, const bool nameGrouped, const unsigned mateWindow, Stats & stats)
+{
+    if (filter.mateConsistent)
+    {
+        MateResolver resolver(output, stats, nameGrouped, mateWindow);
+        runPipeline(reader, numThreads, filter, resolver);
+        finish(resolver);
+    }
+    else if (output.sample != NULL)
+    {
+        SampleCollector collector{*output.sample, stats};
+        runPipeline(reader, numThreads, filter, collector);
+        writeSample(output, *output.sample, stats);
+    }
+    else if (output.duplicates != NULL)
+    {
+        DuplicateWriter writer{output, stats, TextBuffer()};
+        runPipeline(reader, numThreads, filter, writer);
+    }
+    else if (output.type == OUTPUT_FASTQ)
+    {
+        FormatFilter<TFilter> formatFilter{filter, output};
+        FastqWriter writer{output, stats};
+        runPipeline(reader, numThreads, formatFilter, writer);
+    }
+    else if (output.type == OUTPUT_SAM || output.flagStats != NULL || output.checksum)
+    {
+        FormatFilter<TFilter> formatFilter{filter, output};
+        RecordWriter writer{output, stats};
+        runPipeline(reader, numThreads, formatFilter, writer);
+    }
+    else
+    {
+        RecordWriter writer{output, stats};
+        runPipeline(reader, numThreads, filter, writer);
     }
+    finishFastq(output, stats);
 }
 
 #endif /* BAMSUBSET_H_ */
\ No newline at end of file
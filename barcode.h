@@ -0,0 +1,177 @@
+#ifndef BARCODE_H_
+#define BARCODE_H_
+
+#include <seqan/sequence.h>
+#include <cstring>
+#include <iostream>
+#include "rawrecord.h"
+
+using namespace seqan;
+
+// Maximal number of tags combined into one key
+const unsigned MAX_BARCODE_COMPONENTS = 4;
+// Maximal number of fallback tags per component
+const unsigned MAX_BARCODE_TAGS = 4;
+
+// A tag providing a barcode component and the number of characters trimmed from its value
+struct BarcodeTag
+{
+    char key[2];
+    unsigned trim;
+};
+
+// Tags tried in order of priority until one is present
+struct BarcodeComponent
+{
+    BarcodeTag tags[MAX_BARCODE_TAGS];
+    unsigned numTags;
+};
+
+// Barcode key definition, e.g. "CB", "CB,CR" (fallback) or "BC+CB" (composite).
+// Components are separated by '+', fallback tags by ','. A tag can override the trimming as "CR:0".
+struct BarcodeSpec
+{
+    BarcodeComponent components[MAX_BARCODE_COMPONENTS];
+    unsigned numComponents;
+
+    BarcodeSpec(): numComponents(0) {}
+};
+
+// Barcode key of a record, spans into the tag block for each component
+struct BarcodeKey
+{
+    char const * begin[MAX_BARCODE_COMPONENTS];
+    char const * end[MAX_BARCODE_COMPONENTS];
+    unsigned numComponents;
+};
+
+// Parse the barcode tag definition given on the command line
+// Return false and print an error if it is malformed
+inline bool parseBarcodeSpec(BarcodeSpec & spec, const CharString & str, const unsigned toTrim)
+{
+    spec = BarcodeSpec();
+    BarcodeComponent * comp = &spec.components[0];
+    comp->numTags = 0;
+    spec.numComponents = 1;
+
+    unsigned i = 0;
+    while (true)
+    {
+        // TAG[:TRIM]
+        if (i + 2 > length(str) || comp->numTags == MAX_BARCODE_TAGS)
+            break;
+        BarcodeTag & tag = comp->tags[comp->numTags++];
+        tag.key[0] = str[i];
+        tag.key[1] = str[i + 1];
+        tag.trim = toTrim;
+        i += 2;
+        if (i < length(str) && str[i] == ':')
+        {
+            unsigned start = ++i;
+            tag.trim = 0;
+            for (; i < length(str) && std::isdigit(str[i]); ++i)
+                tag.trim = tag.trim * 10 + (str[i] - '0');
+            if (i == start)
+                break;
+        }
+
+        if (i == length(str))
+            return true;
+        if (str[i] == '+')
+        {
+            if (spec.numComponents == MAX_BARCODE_COMPONENTS)
+                break;
+            comp = &spec.components[spec.numComponents++];
+            comp->numTags = 0;
+        }
+        else if (str[i] != ',')
+        {
+            break;
+        }
+        ++i;
+    }
+
+    std::cerr << "ERROR: Invalid barcode tag definition \'" << str << "\'. Expected e.g. CB, CB,CR or BC+CB "
+              << "with at most " << MAX_BARCODE_COMPONENTS << " components of " << MAX_BARCODE_TAGS << " tags.\n";
+    return false;
+}
+
+// Get the barcode key from the tags of a raw BAM record, scanning the tag block once.
+// For each component, the first tag of the fallback list that is present is used.
+inline bool getBarcodeKey(BarcodeKey & key, const RawRecord & record, const BarcodeSpec & spec)
+{
+    unsigned found[MAX_BARCODE_COMPONENTS];
+    unsigned missing = spec.numComponents;
+    for (unsigned c = 0; c < spec.numComponents; ++c)
+        found[c] = spec.components[c].numTags;
+
+    char const * it = tagsBegin(record);
+    char const * tagKey;
+    char const * valBegin;
+    char const * valEnd;
+    char type;
+    while (missing != 0 && nextRawTag(it, tagsEnd(record), tagKey, type, valBegin, valEnd))
+    {
+        if (type != 'Z')
+            continue;
+        for (unsigned c = 0; c < spec.numComponents; ++c)
+        {
+            BarcodeComponent const & comp = spec.components[c];
+            for (unsigned t = 0; t < found[c]; ++t)
+            {
+                if (tagKey[0] != comp.tags[t].key[0] || tagKey[1] != comp.tags[t].key[1])
+                    continue;
+                key.begin[c] = valBegin;
+                key.end[c] = valEnd;
+                found[c] = t;
+                if (t == 0)
+                    --missing;
+                break;
+            }
+        }
+    }
+
+    key.numComponents = spec.numComponents;
+    for (unsigned c = 0; c < spec.numComponents; ++c)
+    {
+        if (found[c] == spec.components[c].numTags)
+            return false;
+        // Trim the last n characters of the barcode
+        unsigned trim = spec.components[c].tags[found[c]].trim;
+        if (static_cast<size_t>(key.end[c] - key.begin[c]) < trim)
+            return false;
+        key.end[c] -= trim;
+    }
+    return true;
+}
+
+// Check if the input is sorted by the barcode tag according to the sub-sort order of the header,
+// e.g. "@HD SO:unknown SS:unknown:TAG:CB" or "SS:unsorted:CB". Only single-tag barcodes are looked up in order.
+// The records are only ordered by the barcode alone if the major sort order is unsorted or unknown and matches SO.
+inline bool isBarcodeSorted(BamHeader const & header, BarcodeSpec const & spec)
+{
+    if (spec.numComponents != 1 || spec.components[0].numTags != 1)
+        return false;
+    char const * key = spec.components[0].tags[0].key;
+    for (unsigned i = 0; i < length(header); ++i)
+    {
+        CharString value;
+        if (header[i].type != BAM_HEADER_FIRST || !getTagValue(value, "SS", header[i]))
+            continue;
+        CharString sortOrder = "unknown";
+        getTagValue(sortOrder, "SO", header[i]);
+        if (sortOrder != "unsorted" && sortOrder != "unknown")
+            return false;
+        // Compare the sort order, skip an optional "TAG:" and compare the first sub-sort key
+        char const * sub = std::strchr(toCString(value), ':');
+        if (sub == NULL || infix(value, 0, sub - toCString(value)) != sortOrder)
+            return false;
+        ++sub;
+        if (std::strncmp(sub, "TAG:", 4) == 0)
+            sub += 4;
+        return sub[0] == key[0] && sub[1] == key[1] && (sub[2] == '\0' || sub[2] == ':');
+    }
+    return false;
+}
+
+#endif /* BARCODE_H_ */
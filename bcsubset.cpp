@@ -1,6 +1,10 @@
+#include <cstring>
+#include "concat.h"
 #include "workflow.h"
 
 int main(int argc, char const * argv[])
 {
+    if (argc > 1 && std::strcmp(argv[1], "concat") == 0)
+        return bamConcat(argc - 1, argv + 1);
     return bamSubset(argc, argv);
 }
@@ -0,0 +1,133 @@
+#ifndef BGZF_H_
+#define BGZF_H_
+
+#include <seqan/stream.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using namespace seqan;
+
+// Raw access to the BGZF blocks of a BAM file, for splitting and joining files without going through the
+// record streams. A block is a gzip member with the extra subfield BC holding the block size - 1,
+// followed by the deflated data, its CRC32 and its uncompressed size.
+
+// The empty block that marks the end of a BGZF file
+const unsigned char BGZF_EOF_BLOCK[28] =
+{
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+// Size of the block starting with a BGZF header at ptr, 0 if there is none
+inline size_t bgzfBlockSize(char const * ptr, size_t available)
+{
+    unsigned char const * p = reinterpret_cast<unsigned char const *>(ptr);
+    if (available < BGZF_BLOCK_HEADER_LENGTH)
+        return 0;
+    if (p[0] != 31 || p[1] != 139 || p[2] != 8 || (p[3] & 4) == 0)
+        return 0;
+    if (p[10] != 6 || p[11] != 0 || p[12] != 'B' || p[13] != 'C' || p[14] != 2 || p[15] != 0)
+        return 0;
+    size_t size = (p[16] | (p[17] << 8)) + 1;
+    return (size < BGZF_BLOCK_HEADER_LENGTH + BGZF_BLOCK_FOOTER_LENGTH) ? 0 : size;
+}
+
+// Uncompressed size of a block, stored in its last 4 bytes
+inline uint32_t bgzfDataSize(char const * block, size_t size)
+{
+    unsigned char const * p = reinterpret_cast<unsigned char const *>(block + size - 4);
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// Read the block at the current position, return false if there is none.
+// The block is left empty at the end of the file.
+inline bool readNextBgzfBlock(std::vector<char> & block, std::FILE * file)
+{
+    block.resize(BGZF_BLOCK_HEADER_LENGTH);
+    size_t n = std::fread(&block[0], 1, BGZF_BLOCK_HEADER_LENGTH, file);
+    if (n != BGZF_BLOCK_HEADER_LENGTH)
+    {
+        block.resize(n);
+        return false;
+    }
+    size_t size = bgzfBlockSize(&block[0], BGZF_BLOCK_HEADER_LENGTH);
+    if (size == 0)
+        return false;
+    block.resize(size);
+    return std::fread(&block[BGZF_BLOCK_HEADER_LENGTH], 1, size - BGZF_BLOCK_HEADER_LENGTH, file) == size - BGZF_BLOCK_HEADER_LENGTH;
+}
+
+// Read the block at the compressed offset, return false at the end of the file or if there is no block
+inline bool readBgzfBlock(std::vector<char> & block, std::FILE * file, uint64_t offset)
+{
+    if (fseeko(file, offset, SEEK_SET) != 0)
+        return false;
+    return readNextBgzfBlock(block, file);
+}
+
+// Append the uncompressed data of a block, return false if it is corrupt
+inline bool inflateBgzfBlock(std::vector<char> & out, char const * block, size_t size)
+{
+    uint32_t dataSize = bgzfDataSize(block, size);
+    if (dataSize > BGZF_MAX_BLOCK_SIZE)
+        return false;
+    size_t begin = out.size();
+    out.resize(begin + dataSize);
+    if (dataSize == 0)
+        return true;
+
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK)
+        return false;
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(block + BGZF_BLOCK_HEADER_LENGTH));
+    zs.avail_in = size - BGZF_BLOCK_HEADER_LENGTH - BGZF_BLOCK_FOOTER_LENGTH;
+    zs.next_out = reinterpret_cast<Bytef *>(&out[begin]);
+    zs.avail_out = dataSize;
+    int res = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (res != Z_STREAM_END || zs.avail_out != 0)
+        return false;
+
+    unsigned char const * p = reinterpret_cast<unsigned char const *>(block + size - BGZF_BLOCK_FOOTER_LENGTH);
+    uint32_t crc = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    return crc == crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<Bytef const *>(&out[begin]), dataSize);
+}
+
+// Append the data as BGZF blocks of at most BGZF_BLOCK_SIZE bytes
+inline void deflateBgzfBlocks(std::vector<char> & out, char const * data, size_t length)
+{
+    for (size_t pos = 0; pos < length; )
+    {
+        size_t dataSize = std::min(length - pos, static_cast<size_t>(BGZF_BLOCK_SIZE));
+        size_t begin = out.size();
+        out.resize(begin + BGZF_MAX_BLOCK_SIZE);
+        unsigned char * block = reinterpret_cast<unsigned char *>(&out[begin]);
+        std::memcpy(block, BGZF_EOF_BLOCK, BGZF_BLOCK_HEADER_LENGTH);
+
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data + pos));
+        zs.avail_in = dataSize;
+        zs.next_out = block + BGZF_BLOCK_HEADER_LENGTH;
+        zs.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_BLOCK_HEADER_LENGTH - BGZF_BLOCK_FOOTER_LENGTH;
+        deflate(&zs, Z_FINISH);
+        size_t size = BGZF_BLOCK_HEADER_LENGTH + zs.total_out + BGZF_BLOCK_FOOTER_LENGTH;
+        deflateEnd(&zs);
+
+        uint32_t crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<Bytef const *>(data + pos), dataSize);
+        uint32_t footer[2] = {crc, static_cast<uint32_t>(dataSize)};
+        for (unsigned i = 0; i < 8; ++i)
+            block[size - BGZF_BLOCK_FOOTER_LENGTH + i] = footer[i / 4] >> (8 * (i % 4));
+        block[16] = (size - 1) & 0xff;
+        block[17] = (size - 1) >> 8;
+        out.resize(begin + size);
+        pos += dataSize;
+    }
+}
+
+#endif /* BGZF_H_ */
@@ -0,0 +1,116 @@
+#ifndef BLOCKSAMPLE_H_
+#define BLOCKSAMPLE_H_
+
+#include <seqan/bam_io.h>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include "bgzf.h"
+#include "pipeline.h"
+#include "split.h"
+
+using namespace seqan;
+
+// Reads the records starting in every k-th BGZF block of a BAM file, one block per batch, to estimate the
+// counts of the whole file. The other blocks are skipped without inflating them.
+struct BlockSampleReader
+{
+    std::FILE * file;
+    uint64_t headerEnd;         // virtual offset of the first record
+    unsigned every;
+    int32_t numRefs;
+    uint64_t offset;            // compressed offset of the next block
+    uint64_t numBlocks;         // blocks behind the header
+    uint64_t sampledBlocks;
+    std::vector<char> block;
+
+    BlockSampleReader(): file(NULL), headerEnd(0), every(1), numRefs(0), offset(0), numBlocks(0), sampledBlocks(0) {}
+
+    ~BlockSampleReader()
+    {
+        if (file != NULL)
+            std::fclose(file);
+    }
+
+    bool operator()(RecordBatch & batch);
+};
+
+inline bool openBlockSample(BlockSampleReader & reader, CharString const & fileName, uint64_t headerEnd,
+                            unsigned every, int32_t numRefs)
+{
+    reader.file = std::fopen(toCString(fileName), "rb");
+    if (reader.file == NULL)
+    {
+        std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+        return false;
+    }
+    reader.headerEnd = headerEnd;
+    reader.every = every;
+    reader.numRefs = numRefs;
+    reader.offset = headerEnd >> 16;
+    return fseeko(reader.file, reader.offset, SEEK_SET) == 0;
+}
+
+// Copy the records starting in the block at the compressed offset into the batch.
+// Without a known start, the first record is found like the boundaries of --split.
+inline void _readBlockRecords(RecordBatch & batch, BlockSampleReader const & reader, uint64_t offset, size_t start,
+                              bool knownStart)
+{
+    SplitScanner scanner(reader.file, offset);
+    _load(scanner, 1);
+    size_t blockEnd = scanner.data.size();
+    size_t pos = start;
+    if (!knownStart)
+        while (pos < blockEnd && !_isRecordStart(scanner, pos, reader.numRefs))
+            ++pos;
+
+    while (pos < blockEnd)
+    {
+        int32_t recordLen;
+        if (!_load(scanner, pos + RAW_SIZE_FIELD))
+            SEQAN_THROW(ParseError("Truncated BAM record."));
+        std::memcpy(&recordLen, &scanner.data[pos], RAW_SIZE_FIELD);
+        if (recordLen < static_cast<int32_t>(sizeof(BamAlignmentRecordCore)))
+            SEQAN_THROW(ParseError("Invalid BAM record size."));
+
+        RawRecord rec;
+        rec.length = RAW_SIZE_FIELD + recordLen;
+        if (!_load(scanner, pos + rec.length))
+            SEQAN_THROW(ParseError("Truncated BAM record."));
+        rec.data = allocate(batch.arena, allocationSize(rec));
+        rec.keep = false;
+        rec.barcode = BARCODE_MISSING;
+        rec.group = 0;
+        std::memcpy(rec.data, &scanner.data[pos], rec.length);
+        if (!isValidRawRecord(rec))
+            SEQAN_THROW(ParseError("Invalid BAM record."));
+        batch.records.push_back(rec);
+        pos += rec.length;
+    }
+}
+
+inline bool BlockSampleReader::operator()(RecordBatch & batch)
+{
+    while (true)
+    {
+        uint64_t blockOffset = offset;
+        if (!readNextBgzfBlock(block, file))
+        {
+            if (!block.empty())
+                SEQAN_THROW(ParseError("Invalid BGZF block."));
+            return false;
+        }
+        offset += block.size();
+        if (bgzfDataSize(&block[0], block.size()) == 0 || numBlocks++ % every != 0)
+            continue;
+
+        ++sampledBlocks;
+        bool first = blockOffset == headerEnd >> 16;
+        _readBlockRecords(batch, *this, blockOffset, first ? (headerEnd & 0xffff) : 0, first);
+        if (fseeko(file, offset, SEEK_SET) != 0)
+            SEQAN_THROW(IOError("Could not seek in the input."));
+        return true;
+    }
+}
+
+#endif /* BLOCKSAMPLE_H_ */
@@ -0,0 +1,193 @@
+#ifndef BUFFERPOOL_H_
+#define BUFFERPOOL_H_
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Alignment of pooled blocks
+const size_t POOL_PAGE_SIZE = 4096;
+
+// Allocate a page-aligned block, throw std::bad_alloc on failure
+inline char * allocatePageAligned(size_t size)
+{
+    void * ptr = NULL;
+    if (posix_memalign(&ptr, POOL_PAGE_SIZE, size) != 0)
+        throw std::bad_alloc();
+    return static_cast<char *>(ptr);
+}
+
+// Pool of page-aligned blocks of a fixed size, shared by all threads.
+// Blocks are allocated up front and recycled, the pool only grows if all blocks are in use.
+struct BlockPool
+{
+    size_t blockSize;
+    std::mutex lock;
+    std::vector<char *> freeBlocks;
+    std::vector<char *> allBlocks;
+
+    BlockPool(size_t blockSize, size_t numBlocks): blockSize(blockSize)
+    {
+        freeBlocks.reserve(numBlocks);
+        allBlocks.reserve(numBlocks);
+        for (size_t i = 0; i < numBlocks; ++i)
+        {
+            allBlocks.push_back(allocatePageAligned(blockSize));
+            freeBlocks.push_back(allBlocks.back());
+        }
+    }
+
+    ~BlockPool()
+    {
+        for (char * block : allBlocks)
+            std::free(block);
+    }
+
+    BlockPool(BlockPool const &) = delete;
+    BlockPool & operator=(BlockPool const &) = delete;
+};
+
+// Take a block from the pool
+inline char * acquireBlock(BlockPool & pool)
+{
+    std::lock_guard<std::mutex> guard(pool.lock);
+    if (pool.freeBlocks.empty())
+    {
+        pool.allBlocks.push_back(allocatePageAligned(pool.blockSize));
+        return pool.allBlocks.back();
+    }
+    char * block = pool.freeBlocks.back();
+    pool.freeBlocks.pop_back();
+    return block;
+}
+
+// Return a block to the pool
+inline void releaseBlock(BlockPool & pool, char * block)
+{
+    std::lock_guard<std::mutex> guard(pool.lock);
+    pool.freeBlocks.push_back(block);
+}
+
+// Bump allocator over pool blocks holding the records of one batch.
+// Requests larger than a pool block get a dedicated allocation that lives until the next reset.
+struct RecordArena
+{
+    BlockPool * pool;
+    std::vector<char *> blocks;
+    std::vector<char *> oversized;
+    char * cur;
+    char * end;
+    size_t used;
+
+    RecordArena(): pool(NULL), cur(NULL), end(NULL), used(0) {}
+
+    RecordArena(RecordArena const &) = delete;
+    RecordArena & operator=(RecordArena const &) = delete;
+
+    ~RecordArena()
+    {
+        for (char * block : oversized)
+            std::free(block);
+        if (pool != NULL)
+            for (char * block : blocks)
+                releaseBlock(*pool, block);
+    }
+};
+
+inline void setPool(RecordArena & arena, BlockPool & pool)
+{
+    arena.pool = &pool;
+    arena.blocks.reserve(4);
+}
+
+// Return size bytes of scratch space from the arena
+inline char * allocate(RecordArena & arena, size_t size)
+{
+    arena.used += size;
+    if (size > arena.pool->blockSize)
+    {
+        arena.oversized.push_back(allocatePageAligned(size));
+        return arena.oversized.back();
+    }
+    if (static_cast<size_t>(arena.end - arena.cur) < size)
+    {
+        arena.blocks.push_back(acquireBlock(*arena.pool));
+        arena.cur = arena.blocks.back();
+        arena.end = arena.cur + arena.pool->blockSize;
+    }
+    char * ptr = arena.cur;
+    arena.cur += size;
+    return ptr;
+}
+
+// Give back the most recent allocation of size bytes at ptr
+inline void deallocateLast(RecordArena & arena, char * ptr, size_t size)
+{
+    arena.used -= size;
+    if (size > arena.pool->blockSize)
+    {
+        std::free(arena.oversized.back());
+        arena.oversized.pop_back();
+    }
+    else if (ptr + size == arena.cur)
+    {
+        arena.cur = ptr;
+    }
+}
+
+// Shrink the most recent allocation at ptr from size to newSize bytes
+inline void shrinkLast(RecordArena & arena, char * ptr, size_t size, size_t newSize)
+{
+    if (size > arena.pool->blockSize || ptr + size != arena.cur)
+        return;
+    arena.used -= size - newSize;
+    arena.cur = ptr + newSize;
+}
+
+// Release all scratch space, keep the first block for the next batch
+inline void reset(RecordArena & arena)
+{
+    for (char * block : arena.oversized)
+        std::free(block);
+    arena.oversized.clear();
+    for (size_t i = 1; i < arena.blocks.size(); ++i)
+        releaseBlock(*arena.pool, arena.blocks[i]);
+    if (arena.blocks.empty())
+    {
+        arena.cur = arena.end = NULL;
+    }
+    else
+    {
+        arena.blocks.resize(1);
+        arena.cur = arena.blocks[0];
+        arena.end = arena.cur + arena.pool->blockSize;
+    }
+    arena.used = 0;
+}
+
+// Growable output buffer that keeps its capacity when cleared, s.t. it is only zero-filled when growing
+struct TextBuffer
+{
+    std::vector<char> data;
+    size_t size;
+
+    TextBuffer(): size(0) {}
+};
+
+// Return space for at least n bytes at the end of the buffer, the caller advances size by the bytes used
+inline char * reserveText(TextBuffer & buffer, size_t n)
+{
+    if (buffer.data.size() < buffer.size + n)
+        buffer.data.resize(std::max(2 * buffer.data.size(), buffer.size + n));
+    return &buffer.data[buffer.size];
+}
+
+inline void clear(TextBuffer & buffer)
+{
+    buffer.size = 0;
+}
+
+#endif /* BUFFERPOOL_H_ */
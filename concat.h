@@ -0,0 +1,341 @@
+#ifndef CONCAT_H_
+#define CONCAT_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include "argparse.h"
+#include "bgzf.h"
+#include "merge.h"
+#include "rawrecord.h"
+
+using namespace seqan;
+
+// Buffer size of the concatenated files
+const size_t CONCAT_BUFFER_SIZE = 4 * 1024 * 1024;
+
+// References of the merged header, owning its name store
+typedef BamIOContext<StringSet<CharString>, NameStoreCache<StringSet<CharString> >, Owner<> > MergedContext;
+
+// Extent of the binary BAM header at the start of the uncompressed data
+struct BamHeaderExtent
+{
+    size_t refsBegin;   // n_ref and the references behind the header text
+    size_t end;
+};
+
+inline bool _readInt32(int32_t & x, std::vector<char> const & data, size_t pos)
+{
+    if (pos + 4 > data.size())
+        return false;
+    std::memcpy(&x, &data[pos], 4);
+    return true;
+}
+
+// Find the end of the BAM header, return false if the data does not hold all of it yet
+inline bool _bamHeaderExtent(BamHeaderExtent & extent, std::vector<char> const & data)
+{
+    int32_t lText;
+    int32_t numRefs;
+    if (!_readInt32(lText, data, 4))
+        return false;
+    extent.refsBegin = 8 + static_cast<size_t>(lText);
+    if (!_readInt32(numRefs, data, extent.refsBegin))
+        return false;
+    size_t pos = extent.refsBegin + 4;
+    for (int32_t i = 0; i < numRefs; ++i)
+    {
+        int32_t lName;
+        if (!_readInt32(lName, data, pos))
+            return false;
+        pos += 4 + static_cast<size_t>(lName) + 4;
+    }
+    if (pos > data.size())
+        return false;
+    extent.end = pos;
+    return true;
+}
+
+// Inflate the first blocks of a BAM file until they hold the header
+inline bool _readBamHeader(std::vector<char> & data, BamHeaderExtent & extent, std::FILE * file,
+                           CharString const & fileName)
+{
+    std::vector<char> block;
+    data.clear();
+    while (data.size() < 4 || !_bamHeaderExtent(extent, data))
+    {
+        if (data.size() >= 4 && std::memcmp(&data[0], "BAM\1", 4) != 0)
+            break;
+        if (!readNextBgzfBlock(block, file) || !inflateBgzfBlock(data, &block[0], block.size()))
+            break;
+    }
+    if (data.size() < 4 || std::memcmp(&data[0], "BAM\1", 4) != 0 || !_bamHeaderExtent(extent, data))
+    {
+        std::cerr << "ERROR: " << fileName << " is not a BAM file.\n";
+        return false;
+    }
+    return true;
+}
+
+// Read the header of an input into the merged header and references.
+// Fails if a reference has a different length than in the inputs before.
+inline bool _mergeInputHeader(BamHeader & merged, MergedContext & context,
+                              String<unsigned> & translation, std::vector<char> const & data,
+                              BamHeaderExtent const & extent, CharString const & fileName, bool first)
+{
+    CharString raw;
+    resize(raw, extent.end);
+    std::copy(data.begin(), data.begin() + extent.end, begin(raw, Standard()));
+
+    size_t numKnownRefs = length(contigNames(context));
+    String<int32_t> knownLengths = contigLengths(context);
+    BamHeader header;
+    Iterator<CharString, Rooted>::Type it = begin(raw);
+    readHeader(header, context, it, Bam());
+    translation = context.translateFile2GlobalRefId;
+
+    if (!checkRefLengths(translation, knownLengths, contigLengths(context), contigNames(context), fileName))
+        return false;
+
+    if (first)
+        merged = header;
+    else
+        mergeBamHeader(merged, header, numKnownRefs, contigNames(context));
+    return true;
+}
+
+inline bool _isIdentity(String<unsigned> const & translation)
+{
+    for (unsigned i = 0; i < length(translation); ++i)
+        if (translation[i] != i)
+            return false;
+    return true;
+}
+
+// Blocks of an input whose records refer to other reference IDs in the output.
+// Blocks are inflated to follow the records through them; only blocks in which a reference ID changed
+// are compressed again, all others are copied.
+struct TranslatingCopier
+{
+    std::vector<char> data;             // uncompressed data of the pending blocks
+    std::vector<char> blocks;           // compressed pending blocks
+    std::vector<size_t> dataEnds;
+    std::vector<size_t> blockEnds;
+    std::vector<char> changed;
+    size_t recordPos;                   // first record not translated yet
+    std::vector<char> compressed;
+    uint64_t copiedBlocks;
+    uint64_t compressedBlocks;
+
+    TranslatingCopier(): recordPos(0), copiedBlocks(0), compressedBlocks(0) {}
+};
+
+inline void _addBlock(TranslatingCopier & copier, char const * block, size_t size, bool changed)
+{
+    copier.blocks.insert(copier.blocks.end(), block, block + size);
+    copier.dataEnds.push_back(copier.data.size());
+    copier.blockEnds.push_back(copier.blocks.size());
+    copier.changed.push_back(changed);
+}
+
+inline void _translateRefId(TranslatingCopier & copier, size_t pos, String<unsigned> const & translation)
+{
+    int32_t refId;
+    std::memcpy(&refId, &copier.data[pos], 4);
+    if (refId < 0 || static_cast<unsigned>(refId) >= length(translation) ||
+        translation[refId] == static_cast<unsigned>(refId))
+        return;
+    int32_t globalId = translation[refId];
+    std::memcpy(&copier.data[pos], &globalId, 4);
+
+    // Blocks holding the bytes of the ID
+    size_t b = std::upper_bound(copier.dataEnds.begin(), copier.dataEnds.end(), pos) - copier.dataEnds.begin();
+    for (; b < copier.dataEnds.size() && (b == 0 || copier.dataEnds[b - 1] < pos + 4); ++b)
+        copier.changed[b] = true;
+}
+
+// Translate the complete records, then write the blocks behind which no record starts before
+inline void _translateRecords(TranslatingCopier & copier, String<unsigned> const & translation, std::FILE * outFile)
+{
+    size_t const rIdOffset = RAW_SIZE_FIELD;
+    size_t const rNextIdOffset = RAW_SIZE_FIELD + offsetof(BamAlignmentRecordCore, rNextId);
+    while (copier.recordPos + RAW_SIZE_FIELD + sizeof(BamAlignmentRecordCore) <= copier.data.size())
+    {
+        int32_t recordLen;
+        std::memcpy(&recordLen, &copier.data[copier.recordPos], RAW_SIZE_FIELD);
+        if (copier.recordPos + RAW_SIZE_FIELD + recordLen > copier.data.size())
+            break;
+        _translateRefId(copier, copier.recordPos + rIdOffset, translation);
+        _translateRefId(copier, copier.recordPos + rNextIdOffset, translation);
+        copier.recordPos += RAW_SIZE_FIELD + recordLen;
+    }
+
+    size_t b = 0;
+    size_t dataBegin = 0;
+    size_t blockBegin = 0;
+    for (; b < copier.dataEnds.size() && copier.dataEnds[b] <= copier.recordPos; ++b)
+    {
+        if (copier.changed[b])
+        {
+            copier.compressed.clear();
+            deflateBgzfBlocks(copier.compressed, &copier.data[0] + dataBegin, copier.dataEnds[b] - dataBegin);
+            std::fwrite(copier.compressed.data(), 1, copier.compressed.size(), outFile);
+            ++copier.compressedBlocks;
+        }
+        else if (copier.dataEnds[b] != dataBegin)
+        {
+            std::fwrite(&copier.blocks[blockBegin], 1, copier.blockEnds[b] - blockBegin, outFile);
+            ++copier.copiedBlocks;
+        }
+        dataBegin = copier.dataEnds[b];
+        blockBegin = copier.blockEnds[b];
+    }
+
+    // Keep the blocks not written
+    copier.data.erase(copier.data.begin(), copier.data.begin() + dataBegin);
+    copier.blocks.erase(copier.blocks.begin(), copier.blocks.begin() + blockBegin);
+    copier.dataEnds.erase(copier.dataEnds.begin(), copier.dataEnds.begin() + b);
+    copier.blockEnds.erase(copier.blockEnds.begin(), copier.blockEnds.begin() + b);
+    copier.changed.erase(copier.changed.begin(), copier.changed.begin() + b);
+    for (size_t i = 0; i < copier.dataEnds.size(); ++i)
+    {
+        copier.dataEnds[i] -= dataBegin;
+        copier.blockEnds[i] -= blockBegin;
+    }
+    copier.recordPos -= dataBegin;
+}
+
+// Join BAM files. The header is the one of the first file, with the references and read groups of the other
+// files added. The compressed blocks of the files are copied, only the records in the blocks of the headers
+// and blocks with reference IDs that differ in the output are compressed again.
+int bamConcat(int argc, char const * argv[])
+{
+    ConcatParameters params;
+    int res = checkParser(parseConcatCommandLine(params, argc, argv));
+    if (res >= 0)
+        return res;
+
+    std::vector<char> inBuffer(CONCAT_BUFFER_SIZE);
+    std::vector<char> data;
+    BamHeaderExtent extent;
+
+    // Merge the headers
+    BamHeader header;
+    MergedContext context;
+    String<String<unsigned> > translations;
+    resize(translations, length(params.bamFileNames));
+    for (unsigned i = 0; i < length(params.bamFileNames); ++i)
+    {
+        CharString const & fileName = params.bamFileNames[i];
+        std::FILE * file = std::fopen(toCString(fileName), "rb");
+        if (file == NULL)
+        {
+            std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+            return 1;
+        }
+        bool ok = _readBamHeader(data, extent, file, fileName) &&
+                  _mergeInputHeader(header, context, translations[i], data, extent, fileName, i == 0);
+        std::fclose(file);
+        if (!ok)
+            return 1;
+    }
+
+    std::FILE * outFile = std::fopen(toCString(params.outBamFileName), "wb");
+    if (outFile == NULL)
+    {
+        std::cerr << "ERROR: Could not open " << params.outBamFileName << " for writing.\n";
+        return 1;
+    }
+    std::vector<char> outBuffer(CONCAT_BUFFER_SIZE);
+    std::setvbuf(outFile, &outBuffer[0], _IOFBF, outBuffer.size());
+
+    CharString headerData;
+    write(headerData, header, context, Bam());
+    std::vector<char> compressed;
+    deflateBgzfBlocks(compressed, begin(headerData, Standard()), length(headerData));
+    std::fwrite(compressed.data(), 1, compressed.size(), outFile);
+
+    std::vector<char> block;
+    uint64_t copiedBlocks = 0;
+    uint64_t compressedBlocks = 0;
+    unsigned translatedFiles = 0;
+    for (unsigned i = 0; i < length(params.bamFileNames); ++i)
+    {
+        CharString const & fileName = params.bamFileNames[i];
+        std::FILE * file = std::fopen(toCString(fileName), "rb");
+        if (file == NULL)
+        {
+            std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+            std::fclose(outFile);
+            return 1;
+        }
+        std::setvbuf(file, &inBuffer[0], _IOFBF, inBuffer.size());
+        bool ok = _readBamHeader(data, extent, file, fileName);
+
+        if (ok && _isIdentity(translations[i]))
+        {
+            // The rest of the blocks of the header, then all other blocks as they are
+            compressed.clear();
+            deflateBgzfBlocks(compressed, data.data() + extent.end, data.size() - extent.end);
+            std::fwrite(compressed.data(), 1, compressed.size(), outFile);
+            while (readNextBgzfBlock(block, file))
+            {
+                if (bgzfDataSize(&block[0], block.size()) == 0)
+                    continue;
+                std::fwrite(&block[0], 1, block.size(), outFile);
+                ++copiedBlocks;
+            }
+        }
+        else if (ok)
+        {
+            TranslatingCopier copier;
+            copier.data.assign(data.begin() + extent.end, data.end());
+            _addBlock(copier, NULL, 0, true);
+            _translateRecords(copier, translations[i], outFile);
+            while (readNextBgzfBlock(block, file))
+            {
+                ok = inflateBgzfBlock(copier.data, &block[0], block.size());
+                if (!ok)
+                    break;
+                _addBlock(copier, &block[0], block.size(), false);
+                _translateRecords(copier, translations[i], outFile);
+            }
+            if (!copier.data.empty())
+                block.push_back(0);     // a record is not complete
+            copiedBlocks += copier.copiedBlocks;
+            compressedBlocks += copier.compressedBlocks;
+            ++translatedFiles;
+        }
+
+        if (ok && !block.empty())
+        {
+            std::cerr << "ERROR: " << fileName << " is truncated or not a BAM file.\n";
+            ok = false;
+        }
+        std::fclose(file);
+        if (!ok)
+        {
+            std::fclose(outFile);
+            return 1;
+        }
+    }
+
+    std::fwrite(BGZF_EOF_BLOCK, 1, sizeof(BGZF_EOF_BLOCK), outFile);
+    if (std::fclose(outFile) != 0)
+    {
+        std::cerr << "ERROR: Could not write " << params.outBamFileName << ".\n";
+        return 1;
+    }
+
+    std::cout << "[bcsubset] Joined " << length(params.bamFileNames) << " files into \'" << params.outBamFileName
+              << "\', copying " << copiedBlocks << " compressed blocks." << std::endl;
+    if (translatedFiles != 0)
+        std::cout << "[bcsubset] Translated the reference IDs of " << translatedFiles << " of the files, compressing "
+                  << compressedBlocks << " blocks again." << std::endl;
+    return 0;
+}
+
+#endif /* CONCAT_H_ */
@@ -0,0 +1,130 @@
+#ifndef COUNTS_H_
+#define COUNTS_H_
+
+#include <seqan/sequence.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "barcode.h"
+#include "pipeline.h"
+#include "whitelist.h"
+
+using namespace seqan;
+
+// Passed records per barcode with --count_only, counted instead of writing the records
+struct BarcodeCounts
+{
+    Whitelist const & wl;
+    BarcodeSpec const & bcSpec;
+    std::vector<uint64_t> slots;                        // records per slot of the whitelist table
+    std::unordered_map<std::string, uint64_t> others;   // records per barcode missing from the table, kept by -x only
+    uint64_t withoutBarcode;                            // records kept by -m without a barcode of their own
+
+    // Sums over the batches of their passed and total records, for the variance of the pass rate
+    // if each batch holds the records of one sampled block
+    uint64_t batches;
+    double sumPassedSq;
+    double sumTotalSq;
+    double sumCross;
+
+    BarcodeCounts(Whitelist const & wl, BarcodeSpec const & bcSpec):
+        wl(wl), bcSpec(bcSpec), slots(wl.slots.size(), 0), withoutBarcode(0), batches(0), sumPassedSq(0),
+        sumTotalSq(0), sumCross(0) {}
+};
+
+// Count a passed record for its barcode, with a second probe of the whitelist table
+inline void countRecord(BarcodeCounts & counts, RawRecord const & rec)
+{
+    BarcodeKey key;
+    if (!getBarcodeKey(key, rec, counts.bcSpec))
+    {
+        ++counts.withoutBarcode;
+        return;
+    }
+    int64_t slot = findBarcode(counts.wl, key, hashKey(key));
+    if (slot >= 0)
+    {
+        ++counts.slots[slot];
+        return;
+    }
+    ++counts.others[keyString(key)];
+}
+
+inline void countBatch(BarcodeCounts & counts, RecordBatch const & batch)
+{
+    for (RawRecord const & rec : batch.records)
+        if (rec.keep)
+            countRecord(counts, rec);
+    double passed = batch.stats.passedReads;
+    double total = batch.stats.passedReads + batch.stats.filteredReads;
+    ++counts.batches;
+    counts.sumPassedSq += passed * passed;
+    counts.sumTotalSq += total * total;
+    counts.sumCross += passed * total;
+}
+
+// Write the barcodes with passed records and their counts as tab-separated lines, sorted by barcode
+inline bool writeBarcodeCounts(BarcodeCounts const & counts, CharString const & fileName)
+{
+    std::vector<std::pair<std::string, uint64_t> > rows(counts.others.begin(), counts.others.end());
+    for (size_t i = 0; i < counts.slots.size(); ++i)
+    {
+        WhitelistSlot const & slot = counts.wl.slots[i];
+        if (counts.slots[i] != 0)
+            rows.push_back(std::make_pair(std::string(&counts.wl.keys[slot.offset], slot.length), counts.slots[i]));
+    }
+    std::sort(rows.begin(), rows.end());
+
+    std::ofstream out(toCString(fileName));
+    if (!out.good())
+    {
+        std::cerr << "ERROR: Could not open " << fileName << " for writing.\n";
+        return false;
+    }
+    out << "barcode\trecords\n";
+    for (std::pair<std::string, uint64_t> const & row : rows)
+        out << row.first << '\t' << row.second << '\n';
+    if (counts.withoutBarcode != 0)
+        out << "*\t" << counts.withoutBarcode << '\n';
+    out.close();
+    if (!out.good())
+    {
+        std::cerr << "ERROR: Could not write " << fileName << ".\n";
+        return false;
+    }
+    std::cout << "[bcsubset] Counts of " << rows.size() << " barcodes have been written to \'" << fileName << "\'."
+              << std::endl;
+    return true;
+}
+
+// Estimate the totals of the whole input from the records of sampledBlocks of numBlocks blocks.
+// The pass rate is a ratio estimate over the sampled blocks as clusters, its 95% confidence interval
+// takes the variance between the blocks into account.
+inline void reportSampleEstimate(BarcodeCounts const & counts, Stats const & stats, uint64_t sampledBlocks,
+                                 uint64_t numBlocks)
+{
+    double passed = stats.passedReads;
+    double total = stats.passedReads + stats.filteredReads;
+    std::cout << "\nESTIMATE from " << sampledBlocks << " of " << numBlocks << " blocks" << std::endl;
+    if (sampledBlocks == 0 || total == 0)
+        return;
+    double scale = static_cast<double>(numBlocks) / sampledBlocks;
+    double rate = passed / total;
+    std::cout << "Total records:\t\t" << static_cast<uint64_t>(total * scale + 0.5) << std::endl;
+    std::cout << "Passed records:\t\t" << static_cast<uint64_t>(passed * scale + 0.5) << "\t(" << rate * 100 << "%";
+    if (sampledBlocks > 1)
+    {
+        double n = sampledBlocks;
+        double residuals = counts.sumPassedSq - 2 * rate * counts.sumCross + rate * rate * counts.sumTotalSq;
+        double variance = (1 - n / numBlocks) * n / (n - 1) * std::max(0.0, residuals) / (total * total);
+        std::cout << " +- " << 1.96 * std::sqrt(variance) * 100 << "%";
+    }
+    std::cout << ")" << std::endl;
+}
+
+#endif /* COUNTS_H_ */
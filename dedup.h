@@ -0,0 +1,168 @@
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <seqan/bam_io.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "rawrecord.h"
+#include "regions.h"
+#include "whitelist.h"
+
+using namespace seqan;
+
+// Initial number of slots of the duplicate table, a power of 2
+const size_t DEDUP_INITIAL_SLOTS = 1 << 12;
+
+// Entry of the duplicate table: the hash of the key of a record and the position it is anchored at.
+// A key is 0 for empty slots.
+struct DedupEntry
+{
+    uint64_t key;
+    int32_t pos;
+};
+
+// Finds records with the same reference, unclipped 5' position, strand, barcode and UMI as a record before them in
+// an input sorted by coordinate. Only the keys of records whose 5' position may still be reached by the following
+// records are kept: the table is swept when it fills up, so its size is bound by the records overlapping a position.
+// Soft clips are at most as long as the reads, so forward records reach back at most the longest read seen.
+struct DuplicateMarker
+{
+    char umiTag[2];
+    bool remove;                    // drop the duplicates instead of flagging them
+    std::vector<DedupEntry> slots;
+    size_t size;
+    int32_t rID;                    // reference and position of the last record
+    int32_t pos;
+    int32_t maxClip;                // longest read seen, bounds the leading soft clips
+
+    DuplicateMarker(char const * tag, bool remove):
+        remove(remove), slots(DEDUP_INITIAL_SLOTS, DedupEntry()), size(0), rID(-1), pos(-1), maxClip(0)
+    {
+        umiTag[0] = tag[0];
+        umiTag[1] = tag[1];
+    }
+};
+
+inline bool isCoordinateSorted(BamHeader const & header)
+{
+    for (unsigned i = 0; i < length(header); ++i)
+    {
+        CharString value;
+        if (header[i].type == BAM_HEADER_FIRST && getTagValue(value, "SO", header[i]))
+            return value == "coordinate";
+    }
+    return false;
+}
+
+// Keep the entries whose positions may still be reached from the current position, in a table grown if they fill a quarter
+inline void _sweepDuplicates(DuplicateMarker & marker)
+{
+    std::vector<DedupEntry> live;
+    for (DedupEntry const & entry : marker.slots)
+        if (entry.key != 0 && entry.pos + marker.maxClip >= marker.pos)
+            live.push_back(entry);
+    size_t numSlots = marker.slots.size();
+    while (live.size() * 4 > numSlots)
+        numSlots *= 2;
+    marker.slots.assign(numSlots, DedupEntry());
+    size_t mask = numSlots - 1;
+    for (DedupEntry const & entry : live)
+    {
+        size_t i = entry.key & mask;
+        while (marker.slots[i].key != 0)
+            i = (i + 1) & mask;
+        marker.slots[i] = entry;
+    }
+    marker.size = live.size();
+}
+
+// Length of the soft clip at the start or end of the CIGAR of a record, behind any hard clip
+inline int32_t _softClipLength(RawRecord const & rec, bool atEnd)
+{
+    unsigned numOps = core(rec)._n_cigar;
+    char const * cigar = cigarBegin(rec);
+    for (unsigned i = 0; i < numOps && i < 2; ++i)
+    {
+        uint32_t op;
+        std::memcpy(&op, cigar + 4 * (atEnd ? numOps - 1 - i : i), 4);
+        if ((op & 0xf) == 4)
+            return op >> 4;
+        if ((op & 0xf) != 5)
+            break;
+    }
+    return 0;
+}
+
+// Hash of the UMI of a record, 0 if it has none. Taken on the filter threads before the tags are edited.
+inline uint64_t umiHash(DuplicateMarker const & marker, RawRecord const & rec)
+{
+    char const * umiBegin;
+    char const * umiEnd;
+    char type;
+    if (!findRawTag(umiBegin, umiEnd, type, tagsBegin(rec), tagsEnd(rec), marker.umiTag) || type != 'Z')
+        return 0;
+    return hashBytes(umiBegin, umiEnd - umiBegin, 0) | 1;
+}
+
+// Check if a kept record duplicates a record before it, otherwise remember its key.
+// Unmapped, secondary and supplementary records and records without barcode or UMI are never duplicates.
+// Records out of coordinate order are counted in unsorted and not checked.
+inline bool isDuplicate(DuplicateMarker & marker, RawRecord const & rec, uint64_t & unsorted)
+{
+    BamAlignmentRecordCore const & c = core(rec);
+    if (c.flag & (BAM_FLAG_UNMAPPED | BAM_FLAG_SECONDARY | BAM_FLAG_SUPPLEMENTARY) || c.rID < 0)
+        return false;
+    if (c.rID < marker.rID || (c.rID == marker.rID && c.beginPos < marker.pos))
+    {
+        ++unsorted;
+        return false;
+    }
+    if (c.rID != marker.rID)
+    {
+        std::fill(marker.slots.begin(), marker.slots.end(), DedupEntry());
+        marker.size = 0;
+    }
+    marker.rID = c.rID;
+    marker.pos = c.beginPos;
+
+    if (rec.barcodeHash == 0 || rec.umiHash == 0)
+        return false;
+
+    // Records are anchored at their unclipped 5' end: the first position for the forward strand, the last
+    // position for the reverse strand, extended by the soft clip on that side
+    bool reverse = (c.flag & BAM_FLAG_RC) != 0;
+    int32_t anchor = reverse ? alignmentEnd(rec) - 1 + _softClipLength(rec, true) :
+                               c.beginPos - _softClipLength(rec, false);
+    marker.maxClip = std::max(marker.maxClip, c._l_qseq);
+    // The barcode is its whitelist slot, or its hash if it is not in the whitelist
+    uint64_t barcode = (rec.slot != NO_SLOT) ? rec.slot : rec.barcodeHash;
+    uint64_t key = mixHash(rec.umiHash ^ mixHash(barcode));
+    key = mixHash(key ^ ((static_cast<uint64_t>(static_cast<uint32_t>(anchor)) << 1) | reverse)) | 1;
+
+    size_t mask = marker.slots.size() - 1;
+    size_t i = key & mask;
+    for (; marker.slots[i].key != 0; i = (i + 1) & mask)
+        if (marker.slots[i].key == key && marker.slots[i].pos == anchor)
+            return true;
+    marker.slots[i].key = key;
+    marker.slots[i].pos = anchor;
+    if (++marker.size * 2 > marker.slots.size())
+        _sweepDuplicates(marker);
+    return false;
+}
+
+// Offset of the flag in a BAM record, behind refID, pos, bin_mq_nl and n_cigar_op
+const unsigned RAW_FLAG_OFFSET = RAW_SIZE_FIELD + 14;
+
+// Set the duplicate flag of a raw record
+inline void setDuplicateFlag(RawRecord & rec)
+{
+    char * field = rec.data + RAW_FLAG_OFFSET;
+    uint16_t flag;
+    std::memcpy(&flag, field, 2);
+    flag |= BAM_FLAG_DUPLICATE;
+    std::memcpy(field, &flag, 2);
+}
+
+#endif /* DEDUP_H_ */
@@ -0,0 +1,108 @@
+#ifndef FASTQ_H_
+#define FASTQ_H_
+
+#include <seqan/bam_io.h>
+#include <seqan/seq_io.h>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "bufferpool.h"
+#include "md5.h"
+#include "rawrecord.h"
+#include "samformat.h"
+#include "seqcodec.h"
+
+using namespace seqan;
+
+// Quality written for records without qualities, as samtools fastq does
+const char FASTQ_DEFAULT_QUAL = 1 + 33;
+
+// Append the FASTQ entry of a raw record, reverse complementing reads aligned to the reverse strand.
+// With mateSuffix, /1 or /2 is appended to the names of paired reads.
+inline void appendFastqRecord(TextBuffer & buffer, RawRecord const & rec, bool mateSuffix)
+{
+    BamAlignmentRecordCore const & c = core(rec);
+    char * const start = reserveText(buffer, c._l_qname + 2 * c._l_qseq + 8);
+    char * out = start;
+    int32_t len = c._l_qseq;
+
+    *out++ = '@';
+    out = formatString(out, qNameBegin(rec), c._l_qname - 1);
+    if (mateSuffix && (c.flag & BAM_FLAG_MULTIPLE))
+    {
+        *out++ = '/';
+        *out++ = (c.flag & BAM_FLAG_LAST) ? '2' : '1';
+    }
+    *out++ = '\n';
+
+    // Sequence, two bases per byte
+    if (!(c.flag & BAM_FLAG_RC))
+        decodeBases(out, seqBegin(rec), len);
+    else
+        decodeBasesReverse(out, seqBegin(rec), len);
+    out += len;
+    out = formatString(out, "\n+\n", 3);
+
+    // Qualities
+    char const * qual = qualBegin(rec);
+    if (len != 0 && static_cast<unsigned char>(qual[0]) == 0xff)
+        std::memset(out, FASTQ_DEFAULT_QUAL, len);
+    else if (!(c.flag & BAM_FLAG_RC))
+        offsetQualities(out, qual, len, 33);
+    else
+        offsetQualitiesReverse(out, qual, len, 33);
+    out += len;
+    *out++ = '\n';
+    buffer.size += out - start;
+}
+
+// Insert the group name before the extension of the file name, e.g. out.fastq.gz -> out.NAME.fastq.gz
+inline CharString groupFileName(CharString const & fileName, CharString const & group)
+{
+    char const * extensions[] = {".fastq.gz", ".fq.gz", ".fastq", ".fq", ".gz"};
+    size_t stem = length(fileName);
+    for (char const * ext : extensions)
+    {
+        if (endsWith(fileName, ext))
+        {
+            stem -= std::strlen(ext);
+            break;
+        }
+    }
+    CharString name = prefix(fileName, stem);
+    appendValue(name, '.');
+    append(name, group);
+    append(name, suffix(fileName, stem));
+    return name;
+}
+
+// FASTQ output files, BGZF compressed if the file name ends in .gz
+struct FastqFiles
+{
+    std::vector<std::unique_ptr<Md5OutStream> > streams;
+    std::vector<std::unique_ptr<SeqFileOut> > files;
+    std::vector<CharString> names;
+};
+
+// With hash, the MD5 of the file is computed while writing it
+inline bool openFastqFile(FastqFiles & fastq, CharString const & fileName, bool hash)
+{
+    fastq.streams.emplace_back(new Md5OutStream());
+    fastq.streams.back()->open(toCString(fileName), hash);
+    fastq.names.push_back(fileName);
+    if (!fastq.streams.back()->good())
+    {
+        std::cerr << "ERROR: Could not open " << fileName << " for writing.\n";
+        return false;
+    }
+    fastq.files.emplace_back(new SeqFileOut());
+    SeqFileOut & file = *fastq.files.back();
+    setFormat(file, Fastq());
+    if (endsWith(fileName, ".gz"))
+        return _open(file, *fastq.streams.back(), BgzfFile(), False());
+    return _open(file, *fastq.streams.back(), Nothing(), False());
+}
+
+#endif /* FASTQ_H_ */
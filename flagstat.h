@@ -0,0 +1,235 @@
+#ifndef FLAGSTAT_H_
+#define FLAGSTAT_H_
+
+#include <seqan/bam_io.h>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "rawrecord.h"
+
+using namespace seqan;
+
+// Categories of samtools flagstat, in the order of its report
+enum FlagCategory
+{
+    FLAG_TOTAL,
+    FLAG_PRIMARY,
+    FLAG_SECONDARY,
+    FLAG_SUPPLEMENTARY,
+    FLAG_DUPLICATES,
+    FLAG_PRIMARY_DUPLICATES,
+    FLAG_MAPPED,
+    FLAG_PRIMARY_MAPPED,
+    FLAG_PAIRED,
+    FLAG_READ1,
+    FLAG_READ2,
+    FLAG_PROPER_PAIR,
+    FLAG_BOTH_MAPPED,
+    FLAG_SINGLETONS,
+    FLAG_MATE_OTHER_CHR,
+    FLAG_MATE_OTHER_CHR_Q5,
+    NUM_FLAG_CATEGORIES
+};
+
+// Counts of the written records like samtools flagstat and idxstats, collected per batch and merged
+struct FlagStats
+{
+    uint64_t counts[2][NUM_FLAG_CATEGORIES];    // QC-passed and QC-failed records
+    std::vector<uint64_t> mapped;               // mapped records per reference
+    std::vector<uint64_t> unmapped;             // unmapped records placed on a reference
+    uint64_t unplaced;                          // unmapped records without a reference
+
+    FlagStats(): unplaced(0)
+    {
+        std::fill(&counts[0][0], &counts[0][0] + 2 * NUM_FLAG_CATEGORIES, 0);
+    }
+};
+
+inline void clear(FlagStats & stats)
+{
+    std::fill(&stats.counts[0][0], &stats.counts[0][0] + 2 * NUM_FLAG_CATEGORIES, 0);
+    std::fill(stats.mapped.begin(), stats.mapped.end(), 0);
+    std::fill(stats.unmapped.begin(), stats.unmapped.end(), 0);
+    stats.unplaced = 0;
+}
+
+// Count a record by the rules of samtools flagstat and idxstats
+inline void addRecord(FlagStats & stats, RawRecord const & rec)
+{
+    BamAlignmentRecordCore const & c = core(rec);
+    uint64_t * n = stats.counts[(c.flag & BAM_FLAG_QC_NO_PASS) ? 1 : 0];
+    bool mapped = !(c.flag & BAM_FLAG_UNMAPPED);
+    ++n[FLAG_TOTAL];
+    if (c.flag & BAM_FLAG_SECONDARY)
+    {
+        ++n[FLAG_SECONDARY];
+    }
+    else if (c.flag & BAM_FLAG_SUPPLEMENTARY)
+    {
+        ++n[FLAG_SUPPLEMENTARY];
+    }
+    else
+    {
+        ++n[FLAG_PRIMARY];
+        if (c.flag & BAM_FLAG_MULTIPLE)
+        {
+            bool mateMapped = !(c.flag & BAM_FLAG_NEXT_UNMAPPED);
+            ++n[FLAG_PAIRED];
+            n[FLAG_PROPER_PAIR] += (c.flag & BAM_FLAG_ALL_PROPER) && mapped;
+            n[FLAG_READ1] += (c.flag & BAM_FLAG_FIRST) != 0;
+            n[FLAG_READ2] += (c.flag & BAM_FLAG_LAST) != 0;
+            n[FLAG_BOTH_MAPPED] += mapped && mateMapped;
+            n[FLAG_SINGLETONS] += mapped && !mateMapped;
+            if (mapped && mateMapped && c.rNextId != c.rID)
+            {
+                ++n[FLAG_MATE_OTHER_CHR];
+                n[FLAG_MATE_OTHER_CHR_Q5] += c.mapQ >= 5;
+            }
+        }
+        n[FLAG_PRIMARY_MAPPED] += mapped;
+        n[FLAG_PRIMARY_DUPLICATES] += (c.flag & BAM_FLAG_DUPLICATE) != 0;
+    }
+    n[FLAG_MAPPED] += mapped;
+    n[FLAG_DUPLICATES] += (c.flag & BAM_FLAG_DUPLICATE) != 0;
+
+    if (c.rID < 0)
+    {
+        ++stats.unplaced;
+        return;
+    }
+    std::vector<uint64_t> & perRef = mapped ? stats.mapped : stats.unmapped;
+    if (static_cast<size_t>(c.rID) >= perRef.size())
+        perRef.resize(c.rID + 1, 0);
+    ++perRef[c.rID];
+}
+
+inline void _mergePerRef(std::vector<uint64_t> & counts, std::vector<uint64_t> const & other)
+{
+    if (counts.size() < other.size())
+        counts.resize(other.size(), 0);
+    for (size_t i = 0; i < other.size(); ++i)
+        counts[i] += other[i];
+}
+
+inline void merge(FlagStats & stats, FlagStats const & other)
+{
+    for (unsigned q = 0; q < 2; ++q)
+        for (unsigned i = 0; i < NUM_FLAG_CATEGORIES; ++i)
+            stats.counts[q][i] += other.counts[q][i];
+    _mergePerRef(stats.mapped, other.mapped);
+    _mergePerRef(stats.unmapped, other.unmapped);
+    stats.unplaced += other.unplaced;
+}
+
+// Labels of the categories in the text report, and the total a category is given as a share of
+struct FlagCategoryInfo
+{
+    char const * text;
+    char const * json;
+    int percentOf;      // category of the total, -1 for no share
+};
+
+const FlagCategoryInfo FLAG_CATEGORIES[NUM_FLAG_CATEGORIES] =
+{
+    {"in total (QC-passed reads + QC-failed reads)", "total", -1},
+    {"primary", "primary", -1},
+    {"secondary", "secondary", -1},
+    {"supplementary", "supplementary", -1},
+    {"duplicates", "duplicates", -1},
+    {"primary duplicates", "primary duplicates", -1},
+    {"mapped", "mapped", FLAG_TOTAL},
+    {"primary mapped", "primary mapped", FLAG_PRIMARY},
+    {"paired in sequencing", "paired in sequencing", -1},
+    {"read1", "read1", -1},
+    {"read2", "read2", -1},
+    {"properly paired", "properly paired", FLAG_PAIRED},
+    {"with itself and mate mapped", "with itself and mate mapped", -1},
+    {"singletons", "singletons", FLAG_PAIRED},
+    {"with mate mapped to a different chr", "with mate mapped to a different chr", -1},
+    {"with mate mapped to a different chr (mapQ>=5)", "with mate mapped to a different chr (mapQ >= 5)", -1}
+};
+
+// Share of a category with two decimals, "N/A" or "null" for an empty total
+inline std::string _percent(uint64_t count, uint64_t total, char const * none, char const * sign)
+{
+    if (total == 0)
+        return none;
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.2f%s", 100.0 * count / total, sign);
+    return buffer;
+}
+
+inline void writeFlagstatText(std::ostream & out, FlagStats const & stats)
+{
+    for (unsigned i = 0; i < NUM_FLAG_CATEGORIES; ++i)
+    {
+        FlagCategoryInfo const & info = FLAG_CATEGORIES[i];
+        out << stats.counts[0][i] << " + " << stats.counts[1][i] << " " << info.text;
+        if (info.percentOf >= 0)
+            out << " (" << _percent(stats.counts[0][i], stats.counts[0][info.percentOf], "N/A", "%") << " : "
+                << _percent(stats.counts[1][i], stats.counts[1][info.percentOf], "N/A", "%") << ")";
+        out << '\n';
+    }
+}
+
+inline void writeFlagstatJson(std::ostream & out, FlagStats const & stats)
+{
+    char const * groups[2] = {"QC-passed reads", "QC-failed reads"};
+    out << "{\n";
+    for (unsigned q = 0; q < 2; ++q)
+    {
+        out << " \"" << groups[q] << "\": {\n";
+        for (unsigned i = 0; i < NUM_FLAG_CATEGORIES; ++i)
+        {
+            FlagCategoryInfo const & info = FLAG_CATEGORIES[i];
+            out << "  \"" << info.json << "\": " << stats.counts[q][i];
+            if (info.percentOf >= 0)
+                out << ",\n  \"" << info.json << " %\": "
+                    << _percent(stats.counts[q][i], stats.counts[q][info.percentOf], "null", "");
+            out << ((i + 1 < NUM_FLAG_CATEGORIES) ? ",\n" : "\n");
+        }
+        out << " }" << ((q == 0) ? ",\n" : "\n");
+    }
+    out << "}\n";
+}
+
+// Reference name, length, mapped and unmapped records like samtools idxstats
+inline void writeIdxstats(std::ostream & out, FlagStats const & stats, StringSet<CharString> const & names,
+                          String<int32_t> const & lengths)
+{
+    for (size_t i = 0; i < length(names); ++i)
+        out << names[i] << '\t' << lengths[i] << '\t' << (i < stats.mapped.size() ? stats.mapped[i] : 0) << '\t'
+            << (i < stats.unmapped.size() ? stats.unmapped[i] : 0) << '\n';
+    out << "*\t0\t0\t" << stats.unplaced << '\n';
+}
+
+// Write the reports next to the output file, as OUT.flagstat, OUT.flagstat.json and OUT.idxstats
+inline bool writeFlagStats(FlagStats const & stats, CharString const & outFileName, StringSet<CharString> const & names,
+                           String<int32_t> const & lengths)
+{
+    char const * suffixes[3] = {".flagstat", ".flagstat.json", ".idxstats"};
+    for (unsigned k = 0; k < 3; ++k)
+    {
+        std::string fileName = std::string(toCString(outFileName)) + suffixes[k];
+        std::ofstream out(fileName.c_str());
+        if (k == 0)
+            writeFlagstatText(out, stats);
+        else if (k == 1)
+            writeFlagstatJson(out, stats);
+        else
+            writeIdxstats(out, stats, names, lengths);
+        out.close();
+        if (!out.good())
+        {
+            std::cerr << "ERROR: Could not write " << fileName << ".\n";
+            return false;
+        }
+    }
+    std::cout << "[bcsubset] Flag and reference counts have been written to \'" << outFileName << ".flagstat\', \'"
+              << outFileName << ".flagstat.json\' and \'" << outFileName << ".idxstats\'." << std::endl;
+    return true;
+}
+
+#endif /* FLAGSTAT_H_ */
@@ -0,0 +1,215 @@
+#ifndef MD5_H_
+#define MD5_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// MD5 of a byte stream (RFC 1321), for the checksums of the output files
+struct Md5
+{
+    uint32_t state[4];
+    uint64_t length;
+    unsigned char block[64];
+
+    Md5(): length(0)
+    {
+        state[0] = 0x67452301;
+        state[1] = 0xefcdab89;
+        state[2] = 0x98badcfe;
+        state[3] = 0x10325476;
+    }
+};
+
+inline uint32_t _md5Rotate(uint32_t x, unsigned n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+inline void _md5Block(Md5 & md5, unsigned char const * data)
+{
+    static const uint32_t K[64] =
+    {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+    };
+    static const unsigned S[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+    uint32_t w[16];
+    for (unsigned i = 0; i < 16; ++i)
+        w[i] = data[4 * i] | (data[4 * i + 1] << 8) | (data[4 * i + 2] << 16) |
+               (static_cast<uint32_t>(data[4 * i + 3]) << 24);
+
+    uint32_t a = md5.state[0], b = md5.state[1], c = md5.state[2], d = md5.state[3];
+    for (unsigned i = 0; i < 64; ++i)
+    {
+        uint32_t f;
+        unsigned g;
+        switch (i / 16)
+        {
+            case 0: f = (b & c) | (~b & d); g = i; break;
+            case 1: f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break;
+            case 2: f = b ^ c ^ d; g = (3 * i + 5) % 16; break;
+            default: f = c ^ (b | ~d); g = (7 * i) % 16; break;
+        }
+        uint32_t t = d;
+        d = c;
+        c = b;
+        b += _md5Rotate(a + f + K[i] + w[g], S[4 * (i / 16) + i % 4]);
+        a = t;
+    }
+    md5.state[0] += a;
+    md5.state[1] += b;
+    md5.state[2] += c;
+    md5.state[3] += d;
+}
+
+inline void update(Md5 & md5, char const * data, size_t length)
+{
+    unsigned char const * p = reinterpret_cast<unsigned char const *>(data);
+    size_t used = md5.length % 64;
+    md5.length += length;
+    if (used != 0)
+    {
+        size_t n = std::min(length, 64 - used);
+        std::memcpy(md5.block + used, p, n);
+        p += n;
+        length -= n;
+        if (used + n < 64)
+            return;
+        _md5Block(md5, md5.block);
+    }
+    for (; length >= 64; p += 64, length -= 64)
+        _md5Block(md5, p);
+    std::memcpy(md5.block, p, length);
+}
+
+// Hex digest of the bytes so far, the state is padded in a copy
+inline std::string hexDigest(Md5 md5)
+{
+    uint64_t bits = md5.length * 8;
+    unsigned char padding[72] = {0x80};
+    size_t padLength = (md5.length % 64 < 56) ? 56 - md5.length % 64 : 120 - md5.length % 64;
+    for (unsigned i = 0; i < 8; ++i)
+        padding[padLength + i] = bits >> (8 * i);
+    update(md5, reinterpret_cast<char const *>(padding), padLength + 8);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string digest;
+    for (unsigned i = 0; i < 16; ++i)
+    {
+        unsigned char byte = md5.state[i / 4] >> (8 * (i % 4));
+        digest += hex[byte >> 4];
+        digest += hex[byte & 15];
+    }
+    return digest;
+}
+
+// File buffer that computes the MD5 of the bytes on their way to the file, if hashing is set
+class Md5FileBuf : public std::streambuf
+{
+public:
+    Md5FileBuf(): hashing(false), buffer(1 << 16)
+    {
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    ~Md5FileBuf()
+    {
+        if (file.is_open())
+            close();
+    }
+
+    bool open(char const * fileName, bool hash)
+    {
+        hashing = hash;
+        return file.open(fileName, std::ios::out | std::ios::binary) != NULL;
+    }
+
+    bool close()
+    {
+        bool flushed = _flush();
+        return file.close() != NULL && flushed;
+    }
+
+    std::string digest() const
+    {
+        return hexDigest(md5);
+    }
+
+protected:
+    int_type overflow(int_type c)
+    {
+        if (!_flush())
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync()
+    {
+        return (_flush() && file.pubsync() == 0) ? 0 : -1;
+    }
+
+private:
+    bool _flush()
+    {
+        std::streamsize n = pptr() - pbase();
+        if (hashing)
+            update(md5, pbase(), n);
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return file.sputn(buffer.data(), n) == n;
+    }
+
+    bool hashing;
+    std::vector<char> buffer;
+    std::filebuf file;
+    Md5 md5;
+};
+
+// Output file stream with the MD5 of the written bytes
+class Md5OutStream : public std::ostream
+{
+public:
+    Md5OutStream(): std::ostream(NULL)
+    {
+        init(&buf);
+    }
+
+    void open(char const * fileName, bool hash)
+    {
+        if (!buf.open(fileName, hash))
+            setstate(std::ios::failbit);
+    }
+
+    void close()
+    {
+        if (!buf.close())
+            setstate(std::ios::failbit);
+    }
+
+    std::string digest() const
+    {
+        return buf.digest();
+    }
+
+private:
+    Md5FileBuf buf;
+};
+
+#endif /* MD5_H_ */
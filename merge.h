@@ -0,0 +1,349 @@
+#ifndef MERGE_H_
+#define MERGE_H_
+
+#include <seqan/bam_io.h>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <thread>
+#include <vector>
+#include "pipeline.h"
+
+using namespace seqan;
+
+// Filtered batches of each input waiting to be merged
+const size_t MERGE_QUEUE_BATCHES = 3;
+
+// Map the reference IDs of the records of an input to the ones of the merged header
+inline void translateRefIds(RecordBatch & batch, String<unsigned> const & translation)
+{
+    size_t const offsets[2] = {0, offsetof(BamAlignmentRecordCore, rNextId)};
+    for (RawRecord & rec : batch.records)
+    {
+        for (size_t offset : offsets)
+        {
+            int32_t refId;
+            char * field = rec.data + RAW_SIZE_FIELD + offset;
+            std::memcpy(&refId, field, 4);
+            if (refId < 0 || static_cast<unsigned>(refId) >= length(translation))
+                continue;
+            refId = translation[refId];
+            std::memcpy(field, &refId, 4);
+        }
+    }
+}
+
+// Add the reference and read group records of a further input to the merged header.
+// References new to the merged header follow the last @SQ record, read groups with new IDs are appended.
+inline void mergeBamHeader(BamHeader & merged, BamHeader const & header, size_t numKnownRefs,
+                           StringSet<CharString> const & refNames)
+{
+    std::set<CharString> newRefs;
+    for (size_t i = numKnownRefs; i < length(refNames); ++i)
+        newRefs.insert(refNames[i]);
+    std::set<CharString> readGroups;
+    size_t lastRef = length(merged);
+    for (unsigned i = 0; i < length(merged); ++i)
+    {
+        CharString id;
+        if (merged[i].type == BAM_HEADER_REFERENCE)
+            lastRef = i + 1;
+        else if (merged[i].type == BAM_HEADER_READ_GROUP && getTagValue(id, "ID", merged[i]))
+            readGroups.insert(id);
+    }
+
+    for (unsigned i = 0; i < length(header); ++i)
+    {
+        CharString name;
+        if (header[i].type == BAM_HEADER_REFERENCE && getTagValue(name, "SN", header[i]) && newRefs.count(name) != 0)
+        {
+            insertValue(merged, lastRef++, header[i]);
+        }
+        else if (header[i].type == BAM_HEADER_READ_GROUP && getTagValue(name, "ID", header[i]) &&
+                 readGroups.insert(name).second)
+        {
+            appendValue(merged, header[i]);
+        }
+    }
+}
+
+// Records of inputs read in turns are in no particular order
+inline void clearSortOrder(BamHeader & header)
+{
+    for (unsigned i = 0; i < length(header); ++i)
+    {
+        unsigned idx;
+        if (header[i].type == BAM_HEADER_FIRST && findTagKey(idx, "SO", header[i]))
+            setTagValue(idx, "unknown", header[i]);
+    }
+}
+
+// Check that the references of an input have the lengths known from the inputs before
+inline bool checkRefLengths(String<unsigned> const & translation, String<int32_t> const & knownLengths,
+                            String<int32_t> const & lengths, StringSet<CharString> const & names,
+                            CharString const & fileName)
+{
+    for (unsigned i = 0; i < length(translation); ++i)
+    {
+        unsigned refId = translation[i];
+        if (refId < length(knownLengths) && knownLengths[refId] != lengths[refId])
+        {
+            std::cerr << "ERROR: The reference " << names[refId] << " of " << fileName
+                      << " has a different length than in the files before.\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check that the references of an input are in the order of the references before, so records sorted by
+// coordinate stay sorted after translating their reference IDs
+inline bool checkRefOrder(String<unsigned> const & translation, StringSet<CharString> const & names,
+                          CharString const & fileName)
+{
+    for (unsigned i = 1; i < length(translation); ++i)
+    {
+        if (translation[i] < translation[i - 1])
+        {
+            std::cerr << "ERROR: The reference " << names[translation[i]] << " of " << fileName
+                      << " is in a different order than in the files before, the inputs cannot be merged"
+                      << " by coordinate with --sorted.\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads the inputs in turns of one batch. The batches are filtered by the pipeline like the ones of a single input.
+struct RoundRobinReader
+{
+    std::vector<BamFileIn *> inFiles;
+    std::vector<String<unsigned> > translations;
+    size_t next;
+
+    bool operator()(RecordBatch & batch)
+    {
+        while (!inFiles.empty())
+        {
+            next %= inFiles.size();
+            if (readBatch(batch, *inFiles[next]))
+            {
+                translateRefIds(batch, translations[next]);
+                ++next;
+                return true;
+            }
+            inFiles.erase(inFiles.begin() + next);
+            translations.erase(translations.begin() + next);
+        }
+        return false;
+    }
+};
+
+// An input of a coordinate merge, read and filtered on its own thread
+struct MergeInput
+{
+    BamFileIn & inFile;
+    String<unsigned> translation;
+    BlockPool pool;
+    std::vector<RecordBatch> batches;
+    std::vector<RecordBatch *> freeBatches;
+    std::queue<RecordBatch *> readyBatches;
+    bool endOfInput;
+    bool aborted;
+    std::exception_ptr error;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread thread;
+
+    RecordBatch * current;          // batch being merged
+    size_t next;                    // next record of the current batch
+    uint64_t lastKey;               // key of the last merged record, to detect unsorted inputs
+
+    MergeInput(BamFileIn & inFile, String<unsigned> const & translation):
+        inFile(inFile), translation(translation), pool(BATCH_SIZE, MERGE_QUEUE_BATCHES),
+        batches(MERGE_QUEUE_BATCHES), endOfInput(false), aborted(false), current(NULL), next(0), lastKey(0)
+    {
+        for (RecordBatch & batch : batches)
+        {
+            initBatch(batch, pool);
+            freeBatches.push_back(&batch);
+        }
+    }
+};
+
+// Read, translate and filter the batches of an input until its end or until the merge is aborted
+template <typename TFilter>
+inline void _runMergeInput(MergeInput & in, TFilter const & filter)
+{
+    try
+    {
+        while (true)
+        {
+            RecordBatch * batch;
+            {
+                std::unique_lock<std::mutex> guard(in.lock);
+                in.changed.wait(guard, [&]{ return in.aborted || !in.freeBatches.empty(); });
+                if (in.aborted)
+                    return;
+                batch = in.freeBatches.back();
+                in.freeBatches.pop_back();
+            }
+            clear(*batch);
+            bool more = readBatch(*batch, in.inFile);
+            if (more)
+            {
+                translateRefIds(*batch, in.translation);
+                filter(*batch);
+            }
+            std::lock_guard<std::mutex> guard(in.lock);
+            if (more)
+                in.readyBatches.push(batch);
+            else
+                in.endOfInput = true;
+            in.changed.notify_all();
+            if (!more)
+                return;
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> guard(in.lock);
+        in.error = std::current_exception();
+        in.endOfInput = true;
+        in.changed.notify_all();
+    }
+}
+
+// Filter of merged batches, whose records were filtered before the merge
+struct MergedFilter
+{
+    bool mateConsistent;
+
+    void operator()(RecordBatch &) const {}
+};
+
+// Coordinate of a record as a sort key, unmapped records last
+inline uint64_t mergeKey(RawRecord const & rec)
+{
+    BamAlignmentRecordCore const & c = core(rec);
+    return (static_cast<uint64_t>(static_cast<uint32_t>(c.rID)) << 32) |
+           static_cast<uint32_t>(c.beginPos + 1);
+}
+
+// Merges inputs sorted by coordinate into batches sorted by coordinate.
+// Each input is read and filtered on its own thread before the merge, so only the kept records are merged.
+// With keepAll, all records are merged for the mates to be resolved after the merge.
+struct SortedMergeReader
+{
+    typedef std::pair<uint64_t, size_t> THeapEntry;     // key of the next record and input
+
+    std::vector<std::unique_ptr<MergeInput> > inputs;
+    std::priority_queue<THeapEntry, std::vector<THeapEntry>, std::greater<THeapEntry> > heap;
+    bool keepAll;
+    bool started;
+
+    SortedMergeReader(): keepAll(false), started(false) {}
+
+    ~SortedMergeReader()
+    {
+        for (std::unique_ptr<MergeInput> & in : inputs)
+        {
+            {
+                std::lock_guard<std::mutex> guard(in->lock);
+                in->aborted = true;
+                in->changed.notify_all();
+            }
+            if (in->thread.joinable())
+                in->thread.join();
+        }
+    }
+
+    bool operator()(RecordBatch & batch);
+};
+
+template <typename TFilter>
+inline void startMerge(SortedMergeReader & reader, std::vector<BamFileIn *> const & inFiles,
+                       std::vector<String<unsigned> > const & translations, TFilter const & filter)
+{
+    for (size_t i = 0; i < inFiles.size(); ++i)
+    {
+        reader.inputs.emplace_back(new MergeInput(*inFiles[i], translations[i]));
+        MergeInput & in = *reader.inputs.back();
+        in.thread = std::thread([&in, &filter]{ _runMergeInput(in, filter); });
+    }
+}
+
+// Move to the next merged record of an input, taking its next batch when the current one is done.
+// The counts of finished batches are added to stats. Return false at the end of the input.
+inline bool _advance(SortedMergeReader & reader, MergeInput & in, Stats & stats)
+{
+    while (true)
+    {
+        if (in.current != NULL)
+        {
+            std::vector<RawRecord> const & records = in.current->records;
+            while (in.next < records.size() && !reader.keepAll && !records[in.next].keep)
+                ++in.next;
+            if (in.next < records.size())
+                return true;
+
+            merge(stats, in.current->stats);
+            std::lock_guard<std::mutex> guard(in.lock);
+            in.freeBatches.push_back(in.current);
+            in.current = NULL;
+            in.changed.notify_all();
+        }
+
+        std::unique_lock<std::mutex> guard(in.lock);
+        in.changed.wait(guard, [&]{ return !in.readyBatches.empty() || in.endOfInput; });
+        if (in.readyBatches.empty())
+        {
+            if (in.error)
+                std::rethrow_exception(in.error);
+            return false;
+        }
+        in.current = in.readyBatches.front();
+        in.readyBatches.pop();
+        in.next = 0;
+    }
+}
+
+inline bool SortedMergeReader::operator()(RecordBatch & batch)
+{
+    if (!started)
+    {
+        for (size_t i = 0; i < inputs.size(); ++i)
+            if (_advance(*this, *inputs[i], batch.stats))
+                heap.push(THeapEntry(mergeKey(inputs[i]->current->records[inputs[i]->next]), i));
+        started = true;
+    }
+
+    while (batch.arena.used < BATCH_SIZE && !heap.empty())
+    {
+        size_t i = heap.top().second;
+        heap.pop();
+        MergeInput & in = *inputs[i];
+        RawRecord rec = in.current->records[in.next++];
+        uint64_t key = mergeKey(rec);
+        if (key < in.lastKey)
+            ++batch.stats.unsortedRecords;
+        in.lastKey = key;
+
+        char * data = allocate(batch.arena, allocationSize(rec));
+        std::memcpy(data, rec.data, rec.length);
+        rec.data = data;
+        batch.records.push_back(rec);
+
+        if (_advance(*this, in, batch.stats))
+            heap.push(THeapEntry(mergeKey(in.current->records[in.next]), i));
+    }
+    return !batch.records.empty() || batch.stats.filteredReads != 0;
+}
+
+#endif /* MERGE_H_ */
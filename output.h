@@ -0,0 +1,372 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <seqan/bam_io.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bufferpool.h"
+#include "counts.h"
+#include "dedup.h"
+#include "fastq.h"
+#include "pipeline.h"
+#include "rawrecord.h"
+#include "reservoir.h"
+#include "samformat.h"
+
+using namespace seqan;
+
+enum OutputType
+{
+    OUTPUT_BAM,
+    OUTPUT_SAM,
+    OUTPUT_FASTQ,
+    OUTPUT_NONE             // the records are only counted, with --count_only
+};
+
+// A FASTQ read of a pair waiting for its mate: a copy of its raw record, its entry and its output group
+struct PendingMate
+{
+    std::string record;
+    std::string entry;
+    uint16_t group;
+    uint64_t ordinal;       // to write the reads left without mate in input order
+};
+
+// Output files and the format of the records written to them.
+// Raw BAM records are copied, SAM lines and FASTQ entries are formatted from them.
+// FASTQ records go to one file per group, or two if read 1 and read 2 are written separately, followed by a file
+// for the singletons: unpaired reads and reads whose mate is not written.
+// The reads of a pair are held back by qName until both are written. In name-grouped input, the reads left
+// when the qName changes have no mate.
+// Without output, the records are counted per barcode.
+struct RecordOutput
+{
+    OutputType type;
+    BamFileOut * bamFileOut;
+    FastqFiles fastq;
+    bool pairedFastq;
+    bool singletonFastq;    // unpaired reads and reads without mate go to a file of their own, with --fastq_singletons
+    bool nameGrouped;       // the reads of a pair are adjacent in the input
+    std::unordered_map<std::string, PendingMate> pendingMates;  // FASTQ reads waiting for their mates, by qName
+    uint64_t numMates;      // reads that waited for their mates
+    StringSet<CharString> const * contigNames;
+    size_t maxContigLength;
+    BarcodeCounts * counts;
+    FlagStats * flagStats;  // flags of the written records, with --flagstat
+    bool checksum;          // sum up the hashes of the written records
+    DuplicateMarker * duplicates;   // marks or removes duplicates of the kept records, with --dedup
+    ReservoirSample * sample;       // samples the kept records per barcode, with --reads_per_barcode
+
+    RecordOutput(): type(OUTPUT_BAM), bamFileOut(NULL), pairedFastq(false), singletonFastq(false), nameGrouped(false),
+                    numMates(0), contigNames(NULL), maxContigLength(1), counts(NULL), flagStats(NULL), checksum(false),
+                    duplicates(NULL), sample(NULL) {}
+};
+
+// Hash of a written record. Their sum is a checksum of the records that does not depend on their order
+// and adds up over batches.
+inline uint64_t recordHash(RawRecord const & rec)
+{
+    return hashBytes(rec.data, rec.length, 0);
+}
+
+// Count the flags and sum up the hash of a written record
+inline void countWritten(RecordOutput & output, RawRecord const & rec, Stats & stats)
+{
+    if (output.flagStats != NULL)
+        addRecord(*output.flagStats, rec);
+    if (output.checksum)
+        stats.recordChecksum += recordHash(rec);
+}
+
+// Index of a FASTQ file of a group: 0 for read 1 or interleaved reads, 1 for read 2, the last one for singletons
+inline unsigned fastqFileIndex(RecordOutput const & output, uint16_t group, unsigned file)
+{
+    return (1 + output.pairedFastq + output.singletonFastq) * group + file;
+}
+
+inline void _writeFastqEntry(RecordOutput & output, unsigned fileIdx, RawRecord const & rec, char const * entry,
+                             size_t length, Stats & stats)
+{
+    write(output.fastq.files[fileIdx]->iter, entry, length);
+    countWritten(output, rec, stats);
+}
+
+inline RawRecord pendingRecord(PendingMate & pending)
+{
+    RawRecord rec = {&pending.record[0], static_cast<uint32_t>(pending.record.size()), true, BARCODE_WHITELISTED,
+                     pending.group, NO_SLOT, 0, 0, 0};
+    return rec;
+}
+
+// Write a read to the singleton file of its group. Without one, unpaired reads of interleaved output go to the
+// output file, other singletons are skipped.
+inline void _writeSingleton(RecordOutput & output, RawRecord const & rec, char const * entry, size_t length,
+                            bool unpaired, Stats & stats)
+{
+    if (output.singletonFastq)
+    {
+        ++stats.singletonReads;
+        _writeFastqEntry(output, fastqFileIndex(output, rec.group, output.pairedFastq ? 2 : 1), rec, entry, length,
+                         stats);
+    }
+    else if (unpaired && !output.pairedFastq)
+    {
+        _writeFastqEntry(output, fastqFileIndex(output, rec.group, 0), rec, entry, length, stats);
+    }
+    else
+    {
+        ++stats.singletonReads;
+    }
+}
+
+// Write the reads still waiting for their mates as singletons, in input order
+inline void _flushPendingMates(RecordOutput & output, Stats & stats)
+{
+    std::vector<PendingMate *> mates;
+    for (auto & pending : output.pendingMates)
+        mates.push_back(&pending.second);
+    std::sort(mates.begin(), mates.end(), [](PendingMate const * a, PendingMate const * b) {
+        return a->ordinal < b->ordinal;
+    });
+    for (PendingMate * mate : mates)
+        _writeSingleton(output, pendingRecord(*mate), mate->entry.data(), mate->entry.size(), false, stats);
+    output.pendingMates.clear();
+}
+
+// Write the FASTQ entry of a record, read 1 and read 2 of a pair together once both have been seen.
+// Both reads of a pair go to the files of the group of read 1.
+inline void writeFastqRecord(RecordOutput & output, RawRecord const & rec, char const * entry, size_t length,
+                             Stats & stats)
+{
+    BamAlignmentRecordCore const & c = core(rec);
+    unsigned mate = c.flag & (BAM_FLAG_FIRST | BAM_FLAG_LAST);
+    std::string name(qNameBegin(rec), c._l_qname - 1);
+    auto it = output.pendingMates.find(name);
+    if (output.nameGrouped && it == output.pendingMates.end() && !output.pendingMates.empty())
+        _flushPendingMates(output, stats);
+    if (!(c.flag & BAM_FLAG_MULTIPLE) || mate == 0 || mate == (BAM_FLAG_FIRST | BAM_FLAG_LAST))
+    {
+        _writeSingleton(output, rec, entry, length, true, stats);
+        return;
+    }
+
+    if (it != output.pendingMates.end() && (core(pendingRecord(it->second)).flag & mate))
+    {
+        // Another read with the same mate flag, the waiting one has no mate
+        _writeSingleton(output, pendingRecord(it->second), it->second.entry.data(), it->second.entry.size(), false,
+                        stats);
+        output.pendingMates.erase(it);
+        it = output.pendingMates.end();
+    }
+    if (it == output.pendingMates.end())
+    {
+        PendingMate & pending = output.pendingMates[name];
+        pending.record.assign(rec.data, rec.length);
+        pending.entry.assign(entry, length);
+        pending.group = rec.group;
+        pending.ordinal = output.numMates++;
+        return;
+    }
+
+    PendingMate & pending = it->second;
+    RawRecord other = pendingRecord(pending);
+    bool first = (mate == BAM_FLAG_FIRST);
+    uint16_t group = first ? rec.group : pending.group;
+    if (first)
+        _writeFastqEntry(output, fastqFileIndex(output, group, 0), rec, entry, length, stats);
+    else
+        _writeFastqEntry(output, fastqFileIndex(output, group, 0), other, pending.entry.data(), pending.entry.size(),
+                         stats);
+    unsigned r2File = fastqFileIndex(output, group, output.pairedFastq ? 1 : 0);
+    if (first)
+        _writeFastqEntry(output, r2File, other, pending.entry.data(), pending.entry.size(), stats);
+    else
+        _writeFastqEntry(output, r2File, rec, entry, length, stats);
+    output.pendingMates.erase(it);
+}
+
+// Write the reads left without mate at the end of the input
+inline void finishFastq(RecordOutput & output, Stats & stats)
+{
+    if (output.type == OUTPUT_FASTQ)
+        _flushPendingMates(output, stats);
+}
+
+inline void formatRecord(TextBuffer & buffer, RecordOutput const & output, RawRecord const & rec)
+{
+    if (output.type == OUTPUT_SAM)
+        appendSamRecord(buffer, rec, *output.contigNames, output.maxContigLength);
+    else
+        appendFastqRecord(buffer, rec, !output.pairedFastq);
+}
+
+inline void writeText(RecordOutput & output, unsigned fileIdx, TextBuffer const & text)
+{
+    if (text.size == 0)
+        return;
+    if (output.type == OUTPUT_SAM)
+        write(output.bamFileOut->iter, &text.data[0], text.size);
+    else
+        write(output.fastq.files[fileIdx]->iter, &text.data[0], text.size);
+}
+
+// Write a single raw record in the output format, scratch holds its text.
+// The flags are counted and the record is hashed once it is written.
+inline void writeRawRecord(RecordOutput & output, TextBuffer & scratch, RawRecord const & rec, Stats & stats)
+{
+    if (output.type == OUTPUT_FASTQ)
+    {
+        clear(scratch);
+        formatRecord(scratch, output, rec);
+        writeFastqRecord(output, rec, &scratch.data[0], scratch.size, stats);
+        return;
+    }
+    countWritten(output, rec, stats);
+    if (output.type == OUTPUT_BAM)
+        write(output.bamFileOut->iter, rec.data, rec.length);
+    else if (output.type == OUTPUT_NONE)
+        countRecord(*output.counts, rec);
+    else
+    {
+        clear(scratch);
+        formatRecord(scratch, output, rec);
+        writeText(output, 0, scratch);
+    }
+}
+
+// Formats the kept records of a batch as text, counts their flags and sums up their hashes after filtering them,
+// on the filter threads. FASTQ entries are only formatted here, the writer pairs the reads and counts the written ones.
+template <typename TFilter>
+struct FormatFilter
+{
+    TFilter const & filter;
+    RecordOutput const & output;
+
+    void operator()(RecordBatch & batch) const
+    {
+        filter(batch);
+        bool text = output.type == OUTPUT_SAM || output.type == OUTPUT_FASTQ;
+        if (text && batch.texts.empty())
+            batch.texts.resize(1);
+        for (RawRecord const & rec : batch.records)
+        {
+            if (!rec.keep)
+                continue;
+            if (text)
+                formatRecord(batch.texts[0], output, rec);
+            if (output.type == OUTPUT_FASTQ)
+            {
+                batch.entryEnds.push_back(batch.texts[0].size);
+                continue;
+            }
+            if (output.flagStats != NULL)
+                addRecord(batch.flagStats, rec);
+            if (output.checksum)
+                batch.stats.recordChecksum += recordHash(rec);
+        }
+    }
+};
+
+// Writes the kept records of each batch to the output files
+struct RecordWriter
+{
+    RecordOutput & output;
+    Stats & stats;
+
+    void operator()(RecordBatch & batch)
+    {
+        if (output.type == OUTPUT_BAM)
+            writeBatch(*output.bamFileOut, batch);
+        else if (output.type == OUTPUT_NONE)
+            countBatch(*output.counts, batch);
+        for (unsigned i = 0; i < batch.texts.size(); ++i)
+            writeText(output, i, batch.texts[i]);
+        merge(stats, batch.stats);
+        if (output.flagStats != NULL)
+            merge(*output.flagStats, batch.flagStats);
+    }
+};
+
+// Writes the FASTQ entries of the kept records of each batch, formatted by the filter threads, pairing the reads
+struct FastqWriter
+{
+    RecordOutput & output;
+    Stats & stats;
+
+    void operator()(RecordBatch & batch)
+    {
+        size_t begin = 0;
+        size_t i = 0;
+        for (RawRecord const & rec : batch.records)
+        {
+            if (!rec.keep)
+                continue;
+            size_t end = batch.entryEnds[i++];
+            writeFastqRecord(output, rec, &batch.texts[0].data[begin], end - begin, batch.stats);
+            begin = end;
+        }
+        merge(stats, batch.stats);
+    }
+};
+
+// Writes the kept records of each batch one by one after checking them for duplicates, which needs the records
+// in input order. The text is formatted, the flags are counted and the records are hashed here.
+struct DuplicateWriter
+{
+    RecordOutput & output;
+    Stats & stats;
+    TextBuffer text;
+
+    void operator()(RecordBatch & batch)
+    {
+        for (RawRecord & rec : batch.records)
+        {
+            if (!rec.keep)
+                continue;
+            if (isDuplicate(*output.duplicates, rec, batch.stats.unsortedRecords))
+            {
+                ++batch.stats.duplicateRecords;
+                if (output.duplicates->remove)
+                    continue;
+                setDuplicateFlag(rec);
+            }
+            writeRawRecord(output, text, rec, batch.stats);
+        }
+        merge(stats, batch.stats);
+    }
+};
+
+// Adds the kept records of each batch to the reservoirs of their barcodes, in input order
+struct SampleCollector
+{
+    ReservoirSample & sample;
+    Stats & stats;
+
+    void operator()(RecordBatch & batch)
+    {
+        for (RawRecord const & rec : batch.records)
+            if (rec.keep)
+                sampleRecord(sample, rec);
+        merge(stats, batch.stats);
+    }
+};
+
+// Write the sampled records at the end of the input
+inline void writeSample(RecordOutput & output, ReservoirSample & sample, Stats & stats)
+{
+    if (!sample.runs.empty())
+        std::cout << "[bcsubset] Merging the sampled records with " << sample.runs.size()
+                  << " temporary runs of " << sample.numSpilled << " records." << std::endl;
+    TextBuffer text;
+    RawRecord rec;
+    startSampleOutput(sample);
+    while (nextSampledRecord(rec, sample))
+    {
+        writeRawRecord(output, text, rec, stats);
+        ++stats.sampledRecords;
+    }
+}
+
+#endif /* OUTPUT_H_ */
@@ -0,0 +1,303 @@
+#ifndef PAIRS_H_
+#define PAIRS_H_
+
+#include <seqan/bam_io.h>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include "pipeline.h"
+#include "output.h"
+#include "whitelist.h"
+
+using namespace seqan;
+
+// Barcode decision for all records sharing a qName
+enum GroupDecision
+{
+    GROUP_UNDECIDED,
+    GROUP_PASS,
+    GROUP_FAIL
+};
+
+struct MateGroup
+{
+    uint8_t decision;
+    bool spilled;           // records of the group were spilled, keep the decision until the end
+    uint16_t group;         // output group of the deciding barcode
+    uint32_t pending;       // records of the group waiting in the queue
+    uint64_t lastSeen;      // number of the last record of the group
+};
+
+// A record waiting for the decision of its group
+struct PendingRecord
+{
+    size_t offset;          // logical offset into MateResolver::buffer
+    uint32_t length;
+    uint64_t nameHash;
+    bool keep;              // record passes the record predicate
+};
+
+// Applies the barcode decision of a read to its mates and its secondary/supplementary alignments.
+// The first record of a qName carrying a barcode decides for all records of that qName. Records wait
+// in input order until their group is decided. Name-grouped inputs are resolved whenever the qName
+// changes. Otherwise undecided records are spilled to a temporary file once more than window records
+// are waiting and are written after all other records when their group is decided later. Passing
+// groups that have not been seen for window records are forgotten, their qName hashes are kept on
+// disk to resolve late spilled mates.
+struct MateResolver
+{
+    RecordOutput & output;
+    Stats & stats;
+    bool nameGrouped;
+    size_t window;
+
+    std::unordered_map<uint64_t, MateGroup> groups;
+    std::deque<PendingRecord> pending;
+    std::deque<std::pair<uint64_t, uint64_t> > seen;    // (qName hash, record number) for expiring groups
+    std::vector<char> buffer;
+    size_t bufferBase;                                  // logical offset of buffer[0]
+    size_t bufferHead;                                  // physical offset of the first pending record
+    uint64_t numRecords;
+    uint64_t currentName;
+    std::FILE * spillFile;
+    std::FILE * expiredFile;                            // qName hashes and output groups of expired passing groups
+    uint64_t numSpilled;
+    TextBuffer text;                                    // SAM line of the record being written
+
+    MateResolver(RecordOutput & output, Stats & stats, bool nameGrouped, size_t window):
+        output(output), stats(stats), nameGrouped(nameGrouped), window(window),
+        bufferBase(0), bufferHead(0), numRecords(0), currentName(0), spillFile(NULL), expiredFile(NULL), numSpilled(0)
+    {}
+
+    ~MateResolver()
+    {
+        if (spillFile != NULL)
+            std::fclose(spillFile);
+        if (expiredFile != NULL)
+            std::fclose(expiredFile);
+    }
+
+    void operator()(RecordBatch & batch);
+};
+
+inline uint64_t hashQName(char const * qName, size_t len)
+{
+    return hashBytes(qName, len, 0);
+}
+
+inline void _emitRecord(MateResolver & me, char const * data, uint32_t length, bool keep, MateGroup const & group)
+{
+    if (keep && group.decision == GROUP_PASS)
+    {
+        RawRecord rec = {const_cast<char *>(data), length, true, BARCODE_MISSING, group.group, NO_SLOT, 0, 0, 0};
+        writeRawRecord(me.output, me.text, rec, me.stats);
+        ++me.stats.passedReads;
+    }
+    else
+    {
+        ++me.stats.filteredReads;
+    }
+}
+
+inline void _writeTemp(std::FILE * & file, void const * data, size_t length)
+{
+    if (file == NULL && (file = std::tmpfile()) == NULL)
+        SEQAN_THROW(IOError("Could not create temporary file for mate records."));
+    if (std::fwrite(data, 1, length, file) != length)
+        SEQAN_THROW(IOError("Could not write to temporary file for mate records."));
+}
+
+// Pop the first pending record, emitting, dropping or spilling it
+inline void _popPending(MateResolver & me, MateGroup & group, bool spill)
+{
+    PendingRecord const & rec = me.pending.front();
+    char const * data = &me.buffer[rec.offset - me.bufferBase];
+    if (!spill)
+    {
+        _emitRecord(me, data, rec.length, rec.keep, group);
+    }
+    else if (rec.keep)
+    {
+        _writeTemp(me.spillFile, data, rec.length);
+        ++me.numSpilled;
+        group.spilled = true;
+    }
+    else
+    {
+        ++me.stats.filteredReads;
+    }
+    --group.pending;
+    me.bufferHead += rec.length;
+    me.pending.pop_front();
+
+    // Drop consumed bytes once they make up half of the buffer
+    if (me.pending.empty())
+    {
+        me.bufferBase += me.buffer.size();
+        me.buffer.clear();
+        me.bufferHead = 0;
+    }
+    else if (2 * me.bufferHead > me.buffer.size())
+    {
+        me.buffer.erase(me.buffer.begin(), me.buffer.begin() + me.bufferHead);
+        me.bufferBase += me.bufferHead;
+        me.bufferHead = 0;
+    }
+}
+
+// Write out all pending records at the front of the queue whose group is decided
+inline void _flushPending(MateResolver & me)
+{
+    while (!me.pending.empty())
+    {
+        MateGroup & group = me.groups[me.pending.front().nameHash];
+        if (group.decision != GROUP_UNDECIDED)
+            _popPending(me, group, false);
+        else if (me.pending.size() > me.window)
+            _popPending(me, group, true);
+        else
+            break;
+    }
+}
+
+// In name-grouped input, all records of the current qName have been seen
+inline void _finishGroup(MateResolver & me)
+{
+    auto it = me.groups.find(me.currentName);
+    if (it == me.groups.end())
+        return;
+    if (it->second.decision == GROUP_UNDECIDED)
+        it->second.decision = GROUP_FAIL;
+    _flushPending(me);
+    if (!it->second.spilled)
+        me.groups.erase(it);
+}
+
+// Forget decided groups that have not been seen for more than window records
+inline void _expireGroups(MateResolver & me)
+{
+    while (!me.seen.empty() && me.seen.front().second + me.window < me.numRecords)
+    {
+        auto it = me.groups.find(me.seen.front().first);
+        if (it != me.groups.end() && it->second.lastSeen == me.seen.front().second &&
+            it->second.pending == 0 && !it->second.spilled)
+        {
+            if (it->second.decision == GROUP_PASS)
+            {
+                uint64_t expired[2] = {it->first, it->second.group};
+                _writeTemp(me.expiredFile, expired, sizeof(expired));
+            }
+            me.groups.erase(it);
+        }
+        me.seen.pop_front();
+    }
+}
+
+inline void MateResolver::operator()(RecordBatch & batch)
+{
+    // Counts of the barcode lookups, the records are counted once their groups are resolved
+    merge(stats, batch.stats);
+    for (RawRecord const & rec : batch.records)
+    {
+        uint64_t nameHash = hashQName(qNameBegin(rec), core(rec)._l_qname - 1);
+        if (nameGrouped && nameHash != currentName)
+        {
+            _finishGroup(*this);
+            currentName = nameHash;
+        }
+
+        MateGroup & group = groups[nameHash];
+        group.lastSeen = numRecords;
+        if (group.decision == GROUP_UNDECIDED && rec.barcode != BARCODE_MISSING)
+        {
+            group.decision = (rec.barcode == BARCODE_WHITELISTED) ? GROUP_PASS : GROUP_FAIL;
+            group.group = rec.group;
+        }
+
+        if (pending.empty() && group.decision != GROUP_UNDECIDED)
+        {
+            _emitRecord(*this, rec.data, rec.length, rec.keep, group);
+        }
+        else
+        {
+            PendingRecord pend = {bufferBase + buffer.size(), rec.length, nameHash, rec.keep};
+            buffer.insert(buffer.end(), rec.data, rec.data + rec.length);
+            pending.push_back(pend);
+            ++group.pending;
+        }
+
+        if (!nameGrouped)
+        {
+            seen.emplace_back(nameHash, numRecords);
+            ++numRecords;
+            _flushPending(*this);
+            _expireGroups(*this);
+        }
+    }
+}
+
+// Resolve the remaining records at the end of the input, including the spilled ones
+inline void finish(MateResolver & me)
+{
+    if (me.nameGrouped)
+        _finishGroup(me);
+
+    // Late mates of expired passing groups
+    if (me.expiredFile != NULL)
+    {
+        std::rewind(me.expiredFile);
+        uint64_t expired[2];
+        while (std::fread(expired, sizeof(expired), 1, me.expiredFile) == 1)
+        {
+            auto it = me.groups.find(expired[0]);
+            if (it != me.groups.end() && it->second.decision == GROUP_UNDECIDED)
+            {
+                it->second.decision = GROUP_PASS;
+                it->second.group = expired[1];
+            }
+        }
+    }
+    for (auto & group : me.groups)
+        if (group.second.decision == GROUP_UNDECIDED)
+            group.second.decision = GROUP_FAIL;
+    _flushPending(me);
+
+    if (me.spillFile == NULL)
+        return;
+
+    std::cout << "[bcsubset] Resolving " << me.numSpilled << " records whose mates were not found within "
+              << me.window << " records." << std::endl;
+    std::rewind(me.spillFile);
+    std::vector<char> data;
+    int32_t recordLen;
+    while (std::fread(&recordLen, sizeof(recordLen), 1, me.spillFile) == 1)
+    {
+        data.resize(RAW_SIZE_FIELD + recordLen);
+        std::memcpy(&data[0], &recordLen, RAW_SIZE_FIELD);
+        if (std::fread(&data[RAW_SIZE_FIELD], 1, recordLen, me.spillFile) != static_cast<size_t>(recordLen))
+            SEQAN_THROW(IOError("Could not read temporary file for mate records."));
+        RawRecord rec = {&data[0], static_cast<uint32_t>(data.size()), true, BARCODE_MISSING, 0, NO_SLOT, 0, 0, 0};
+        uint64_t nameHash = hashQName(qNameBegin(rec), core(rec)._l_qname - 1);
+        _emitRecord(me, rec.data, rec.length, true, me.groups[nameHash]);
+    }
+}
+
+// Check whether records of the same qName are adjacent, according to @HD SO or GO
+inline bool isNameGrouped(BamHeader const & header)
+{
+    for (unsigned i = 0; i < length(header); ++i)
+    {
+        if (header[i].type != BAM_HEADER_FIRST)
+            continue;
+        CharString value;
+        if (getTagValue(value, "SO", header[i]) && value == "queryname")
+            return true;
+        if (getTagValue(value, "GO", header[i]) && value == "query")
+            return true;
+    }
+    return false;
+}
+
+#endif /* PAIRS_H_ */
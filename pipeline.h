@@ -0,0 +1,283 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <seqan/bam_io.h>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "bufferpool.h"
+#include "flagstat.h"
+#include "rawrecord.h"
+#include "stats.h"
+
+using namespace seqan;
+
+// Bytes of raw records collected into one batch
+const size_t BATCH_SIZE = 1024 * 1024;
+
+// Records in a typical batch, used to reserve the record index up front
+const size_t BATCH_RECORDS = BATCH_SIZE / 256;
+
+// A batch of raw records, its arena and the counts collected while filtering it
+struct RecordBatch
+{
+    RecordArena arena;
+    std::vector<RawRecord> records;
+    TextBuffer lines;       // SAM input lines, parsed into records by the filter threads
+    std::vector<TextBuffer> texts;  // kept records formatted for text output, per output file
+    std::vector<size_t> entryEnds;  // end of the FASTQ entry of each kept record in the first text
+    Stats stats;
+    FlagStats flagStats;    // flags of the kept records with --flagstat
+    size_t seqNo;
+
+    RecordBatch(): seqNo(0) {}
+};
+
+inline void initBatch(RecordBatch & batch, BlockPool & pool)
+{
+    setPool(batch.arena, pool);
+    batch.records.reserve(BATCH_RECORDS);
+}
+
+inline void clear(RecordBatch & batch)
+{
+    batch.records.clear();
+    reset(batch.arena);
+    clear(batch.lines);
+    for (TextBuffer & text : batch.texts)
+        clear(text);
+    batch.entryEnds.clear();
+    batch.stats = Stats();
+    clear(batch.flagStats);
+}
+
+// Size of the arena allocation of a record, rounded up to keep the record core 4-byte aligned
+inline size_t allocationSize(RawRecord const & rec)
+{
+    return (rec.length + 7) & ~static_cast<size_t>(7);
+}
+
+// Read the next raw record and append it to the batch
+inline void readRawRecord(RecordBatch & batch, BamFileIn & inFile)
+{
+    int32_t recordLen = 0;
+    readRawPod(recordLen, inFile.iter);
+
+    // fail, if we read "BAM\1" (readHeader() was not called)
+    if (recordLen == 0x014D4142)
+        SEQAN_THROW(ParseError("Unexpected BAM header encountered."));
+    if (recordLen < static_cast<int32_t>(sizeof(BamAlignmentRecordCore)))
+        SEQAN_THROW(ParseError("Invalid BAM record size."));
+
+    RawRecord rec;
+    rec.length = RAW_SIZE_FIELD + recordLen;
+    rec.data = allocate(batch.arena, allocationSize(rec));
+    rec.keep = false;
+    rec.barcode = BARCODE_MISSING;
+    rec.group = 0;
+    std::memcpy(rec.data, &recordLen, RAW_SIZE_FIELD);
+    write(rec.data + RAW_SIZE_FIELD, inFile.iter, static_cast<size_t>(recordLen));
+
+    if (!isValidRawRecord(rec))
+        SEQAN_THROW(ParseError("Invalid BAM record."));
+    batch.records.push_back(rec);
+}
+
+// Remove the last record read into the batch and give back its space
+inline void dropLastRecord(RecordBatch & batch)
+{
+    RawRecord const & rec = batch.records.back();
+    deallocateLast(batch.arena, rec.data, allocationSize(rec));
+    batch.records.pop_back();
+}
+
+// Read raw records into the batch until it is full
+// Return false if there were no more records
+inline bool readBatch(RecordBatch & batch, BamFileIn & inFile)
+{
+    while (batch.arena.used < BATCH_SIZE && !atEnd(inFile))
+        readRawRecord(batch, inFile);
+    return !batch.records.empty();
+}
+
+// Reads all records of a BAM file in batches
+struct BamReader
+{
+    BamFileIn & inFile;
+
+    bool operator()(RecordBatch & batch)
+    {
+        return readBatch(batch, inFile);
+    }
+};
+
+// Write the records of the batch marked to be kept
+inline void writeBatch(BamFileOut & bamFileOut, RecordBatch const & batch)
+{
+    for (RawRecord const & rec : batch.records)
+        if (rec.keep)
+            write(bamFileOut.iter, rec.data, rec.length);
+}
+
+// Read the input in batches, filter them on numThreads worker threads and pass them to sink in input order.
+// reader(batch) fills a batch and returns false at the end of the input.
+// filter(batch) must be thread-safe, sink(batch) is called from a single thread.
+template <typename TReader, typename TFilter, typename TSink>
+inline void runPipeline(TReader & reader, unsigned numThreads, TFilter & filter, TSink & sink)
+{
+    size_t numBatches = 2 * numThreads + 2;
+    BlockPool pool(BATCH_SIZE, numBatches + numThreads);
+
+    if (numThreads <= 1)
+    {
+        RecordBatch batch;
+        initBatch(batch, pool);
+        while (reader(batch))
+        {
+            filter(batch);
+            sink(batch);
+            clear(batch);
+        }
+        return;
+    }
+
+    std::vector<RecordBatch> batches(numBatches);
+    std::vector<RecordBatch *> freeBatches;
+    std::vector<RecordBatch *> todo(numBatches, NULL);
+    std::vector<RecordBatch *> done(numBatches, NULL);
+    size_t todoHead = 0, todoCount = 0;
+    size_t numRead = 0;
+    bool endOfInput = false;
+    bool aborted = false;
+    std::exception_ptr error;
+    std::mutex lock;
+    std::condition_variable changed;
+
+    freeBatches.reserve(numBatches);
+    for (RecordBatch & batch : batches)
+    {
+        initBatch(batch, pool);
+        freeBatches.push_back(&batch);
+    }
+
+    auto fail = [&](std::exception_ptr e)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!error)
+            error = e;
+        aborted = true;
+        changed.notify_all();
+    };
+
+    auto worker = [&]()
+    {
+        try
+        {
+            while (true)
+            {
+                RecordBatch * batch;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    changed.wait(guard, [&]{ return aborted || todoCount != 0 || endOfInput; });
+                    if (aborted || todoCount == 0)
+                        return;
+                    batch = todo[todoHead];
+                    todoHead = (todoHead + 1) % numBatches;
+                    --todoCount;
+                }
+                filter(*batch);
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    done[batch->seqNo % numBatches] = batch;
+                    changed.notify_all();
+                }
+            }
+        }
+        catch (...)
+        {
+            fail(std::current_exception());
+        }
+    };
+
+    auto writer = [&]()
+    {
+        try
+        {
+            for (size_t next = 0; ; ++next)
+            {
+                RecordBatch * batch;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    changed.wait(guard, [&]{ return aborted || done[next % numBatches] != NULL ||
+                                                    (endOfInput && next == numRead); });
+                    if (aborted || done[next % numBatches] == NULL)
+                        return;
+                    batch = done[next % numBatches];
+                    done[next % numBatches] = NULL;
+                }
+                sink(*batch);
+                clear(*batch);
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    freeBatches.push_back(batch);
+                    changed.notify_all();
+                }
+            }
+        }
+        catch (...)
+        {
+            fail(std::current_exception());
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < numThreads; ++i)
+        threads.emplace_back(worker);
+    threads.emplace_back(writer);
+
+    try
+    {
+        while (true)
+        {
+            RecordBatch * batch;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]{ return aborted || !freeBatches.empty(); });
+                if (aborted)
+                    break;
+                batch = freeBatches.back();
+                freeBatches.pop_back();
+            }
+            batch->seqNo = numRead;
+            bool more = reader(*batch);
+            std::lock_guard<std::mutex> guard(lock);
+            if (more)
+            {
+                todo[(todoHead + todoCount) % numBatches] = batch;
+                ++todoCount;
+                ++numRead;
+            }
+            else
+            {
+                freeBatches.push_back(batch);
+                endOfInput = true;
+            }
+            changed.notify_all();
+            if (!more)
+                break;
+        }
+    }
+    catch (...)
+    {
+        fail(std::current_exception());
+    }
+
+    for (std::thread & thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+#endif /* PIPELINE_H_ */
@@ -0,0 +1,455 @@
+#ifndef PREDICATE_H_
+#define PREDICATE_H_
+
+#include <seqan/sequence.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "rawrecord.h"
+#include "regions.h"
+
+using namespace seqan;
+
+// Kinds of predicate ops, in the order of their evaluation cost
+enum PredicateCode
+{
+    PRED_FLAG_ANY,          // flag & value != 0
+    PRED_FLAG_ALL,          // flag & value == value
+    PRED_FIELD,             // compare a core field with value
+    PRED_CONTIG,            // rID contained in a contig set
+    PRED_REGION,            // alignment overlaps RecordPredicate::regions
+    PRED_QNAME,             // qName matches a glob pattern
+    PRED_TAG_EXISTS,        // tag is present
+    PRED_TAG_CMP            // compare a tag value with value or a string
+};
+
+enum PredicateField
+{
+    FIELD_FLAG,
+    FIELD_MAPQ,
+    FIELD_POS,
+    FIELD_TLEN,
+    FIELD_QLEN
+};
+
+enum PredicateCmp
+{
+    CMP_EQ,
+    CMP_NE,
+    CMP_LT,
+    CMP_LE,
+    CMP_GT,
+    CMP_GE
+};
+
+// One test on a raw record, evaluated on the record core where possible
+struct PredicateOp
+{
+    PredicateCode code;
+    PredicateField field;
+    PredicateCmp cmp;
+    bool negate;
+    bool isNumber;          // value/fvalue hold the literal of PRED_TAG_CMP
+    char key[2];
+    int64_t value;
+    double fvalue;
+    unsigned arg;           // index into RecordPredicate::strings or contigSets
+};
+
+// Conjunction of predicate ops, sorted by evaluation cost
+struct RecordPredicate
+{
+    std::vector<PredicateOp> ops;
+    std::vector<std::string> strings;
+    std::vector<std::vector<char> > contigSets;     // indexed by rID + 1, s.t. unmapped records have index 0
+    RegionIndex regions;
+};
+
+// ----------------------------------------------------------------------------
+// Evaluation
+// ----------------------------------------------------------------------------
+
+template <typename TValue>
+inline bool compareValues(TValue a, TValue b, PredicateCmp cmp)
+{
+    switch (cmp)
+    {
+        case CMP_EQ: return a == b;
+        case CMP_NE: return a != b;
+        case CMP_LT: return a < b;
+        case CMP_LE: return a <= b;
+        case CMP_GT: return a > b;
+        default:     return a >= b;
+    }
+}
+
+// Glob matching with '*' and '?' wildcards
+inline bool matchesGlob(char const * str, char const * strEnd, char const * pat, char const * patEnd)
+{
+    char const * starPat = NULL;
+    char const * starStr = NULL;
+    while (str != strEnd)
+    {
+        if (pat != patEnd && (*pat == '?' || *pat == *str))
+        {
+            ++str;
+            ++pat;
+        }
+        else if (pat != patEnd && *pat == '*')
+        {
+            starPat = pat++;
+            starStr = str;
+        }
+        else if (starPat != NULL)
+        {
+            pat = starPat + 1;
+            str = ++starStr;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (pat != patEnd && *pat == '*')
+        ++pat;
+    return pat == patEnd;
+}
+
+inline int64_t fieldValue(RawRecord const & rec, PredicateField field)
+{
+    BamAlignmentRecordCore const & c = core(rec);
+    switch (field)
+    {
+        case FIELD_FLAG: return c.flag;
+        case FIELD_MAPQ: return c.mapQ;
+        case FIELD_POS:  return static_cast<int64_t>(c.beginPos) + 1;
+        case FIELD_TLEN: return c.tLen;
+        default:         return c._l_qseq;
+    }
+}
+
+// Read an integer or float tag value as double, return false for other types
+inline bool tagNumber(double & result, char type, char const * val)
+{
+    switch (type)
+    {
+        case 'c': { int8_t v; std::memcpy(&v, val, 1); result = v; return true; }
+        case 'C': { uint8_t v; std::memcpy(&v, val, 1); result = v; return true; }
+        case 's': { int16_t v; std::memcpy(&v, val, 2); result = v; return true; }
+        case 'S': { uint16_t v; std::memcpy(&v, val, 2); result = v; return true; }
+        case 'i': { int32_t v; std::memcpy(&v, val, 4); result = v; return true; }
+        case 'I': { uint32_t v; std::memcpy(&v, val, 4); result = v; return true; }
+        case 'f': { float v; std::memcpy(&v, val, 4); result = v; return true; }
+        default: return false;
+    }
+}
+
+inline bool evalOp(RecordPredicate const & pred, PredicateOp const & op, RawRecord const & rec)
+{
+    switch (op.code)
+    {
+        case PRED_FLAG_ANY:
+            return (core(rec).flag & op.value) != 0;
+        case PRED_FLAG_ALL:
+            return (core(rec).flag & op.value) == op.value;
+        case PRED_FIELD:
+            return compareValues(fieldValue(rec, op.field), op.value, op.cmp);
+        case PRED_CONTIG:
+        {
+            std::vector<char> const & contigs = pred.contigSets[op.arg];
+            size_t idx = static_cast<size_t>(core(rec).rID + 1);
+            return idx < contigs.size() && contigs[idx];
+        }
+        case PRED_REGION:
+            return overlapsRegions(pred.regions, rec);
+        case PRED_QNAME:
+        {
+            std::string const & pattern = pred.strings[op.arg];
+            char const * name = qNameBegin(rec);
+            return matchesGlob(name, name + std::strlen(name), pattern.data(), pattern.data() + pattern.size());
+        }
+        default:
+            break;
+    }
+
+    // tag ops
+    char const * valBegin;
+    char const * valEnd;
+    char type;
+    if (!findRawTag(valBegin, valEnd, type, tagsBegin(rec), tagsEnd(rec), op.key))
+        return false;
+    if (op.code == PRED_TAG_EXISTS)
+        return true;
+
+    double number;
+    if (tagNumber(number, type, valBegin))
+        return op.isNumber && compareValues(number, op.fvalue, op.cmp);
+    if (type != 'Z' && type != 'A')
+        return false;
+
+    std::string const & str = pred.strings[op.arg];
+    int res = std::memcmp(valBegin, str.data(), std::min(str.size(), static_cast<size_t>(valEnd - valBegin)));
+    if (res == 0)
+        res = (valEnd - valBegin < static_cast<int64_t>(str.size())) ? -1 : (valEnd - valBegin > static_cast<int64_t>(str.size()));
+    return compareValues(res, 0, op.cmp);
+}
+
+// Evaluate all ops, cheapest first, stop at the first failing one
+inline bool matchesPredicate(RecordPredicate const & pred, RawRecord const & rec)
+{
+    for (PredicateOp const & op : pred.ops)
+        if (evalOp(pred, op, rec) == op.negate)
+            return false;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Compilation
+// ----------------------------------------------------------------------------
+
+// Tokenizer for filter expressions
+struct ExpressionLexer
+{
+    std::string const & expr;
+    size_t pos;
+    std::string token;
+    bool isWord;
+
+    ExpressionLexer(std::string const & expr): expr(expr), pos(0), isWord(false) {}
+};
+
+// Read the next token: an operator, a bare or quoted word, or an empty token at the end
+inline bool nextToken(ExpressionLexer & lex)
+{
+    static char const * OPERATOR_CHARS = "!&<>=~[]";
+    static char const * OPERATORS[] = {"&&", "==", "!=", "<=", ">=", "&", "!", "<", ">", "~", "[", "]"};
+
+    std::string const & expr = lex.expr;
+    while (lex.pos < expr.size() && std::isspace(expr[lex.pos]))
+        ++lex.pos;
+    lex.token.clear();
+    lex.isWord = false;
+    if (lex.pos == expr.size())
+        return true;
+
+    if (expr[lex.pos] == '"')
+    {
+        size_t end = expr.find('"', lex.pos + 1);
+        if (end == std::string::npos)
+            return false;
+        lex.token = expr.substr(lex.pos + 1, end - lex.pos - 1);
+        lex.isWord = true;
+        lex.pos = end + 1;
+        return true;
+    }
+    for (char const * op : OPERATORS)
+    {
+        if (expr.compare(lex.pos, std::strlen(op), op) == 0)
+        {
+            lex.token = op;
+            lex.pos += lex.token.size();
+            return true;
+        }
+    }
+    while (lex.pos < expr.size() && !std::isspace(expr[lex.pos]) && std::strchr(OPERATOR_CHARS, expr[lex.pos]) == NULL)
+        lex.token += expr[lex.pos++];
+    lex.isWord = true;
+    return true;
+}
+
+inline bool parseCmp(PredicateCmp & cmp, std::string const & token)
+{
+    static char const * CMP_TOKENS[] = {"==", "!=", "<", "<=", ">", ">="};
+    for (unsigned i = 0; i < 6; ++i)
+    {
+        if (token == CMP_TOKENS[i])
+        {
+            cmp = static_cast<PredicateCmp>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool parseInteger(int64_t & value, std::string const & token)
+{
+    if (token.empty())
+        return false;
+    char * end;
+    value = std::strtoll(token.c_str(), &end, 0);
+    return *end == '\0';
+}
+
+inline bool parseNumber(double & value, std::string const & token)
+{
+    if (token.empty())
+        return false;
+    char * end;
+    value = std::strtod(token.c_str(), &end);
+    return *end == '\0';
+}
+
+// Resolve a comma-separated list of contig names into a set indexed by rID + 1
+inline bool parseContigSet(std::vector<char> & contigs, std::string const & list, StringSet<CharString> const & contigNames)
+{
+    contigs.assign(length(contigNames) + 1, 0);
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t end = std::min(list.find(',', start), list.size());
+        std::string name = list.substr(start, end - start);
+        if (name == "*")
+        {
+            contigs[0] = 1;
+        }
+        else
+        {
+            unsigned i = 0;
+            for (; i < length(contigNames); ++i)
+                if (contigNames[i] == name.c_str())
+                    break;
+            if (i == length(contigNames))
+            {
+                std::cerr << "ERROR: Unknown contig \'" << name << "\' in filter expression.\n";
+                return false;
+            }
+            contigs[i + 1] = 1;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+// Parse one term of a filter expression into an op
+inline bool parseTerm(RecordPredicate & pred, PredicateOp & op, ExpressionLexer & lex, StringSet<CharString> const & contigNames)
+{
+    static char const * FIELDS[] = {"flag", "mapq", "pos", "tlen", "qlen"};
+
+    op = PredicateOp();
+    while (!lex.isWord && lex.token == "!")
+    {
+        op.negate = !op.negate;
+        if (!nextToken(lex))
+            return false;
+    }
+
+    // [XX] or [XX] CMP VALUE
+    if (!lex.isWord && lex.token == "[")
+    {
+        if (!nextToken(lex) || !lex.isWord || lex.token.size() != 2)
+            return false;
+        op.key[0] = lex.token[0];
+        op.key[1] = lex.token[1];
+        if (!nextToken(lex) || lex.token != "]" || !nextToken(lex))
+            return false;
+        op.code = PRED_TAG_EXISTS;
+        if (lex.isWord || !parseCmp(op.cmp, lex.token))
+            return true;
+        if (!nextToken(lex) || !lex.isWord)
+            return false;
+        op.code = PRED_TAG_CMP;
+        op.isNumber = parseNumber(op.fvalue, lex.token);
+        op.arg = pred.strings.size();
+        pred.strings.push_back(lex.token);
+        return nextToken(lex);
+    }
+    if (!lex.isWord)
+        return false;
+
+    std::string name = lex.token;
+    if (!nextToken(lex))
+        return false;
+
+    // rname in LIST, rname == NAME, rname != NAME
+    if (name == "rname")
+    {
+        bool isList = lex.isWord && lex.token == "in";
+        if (!isList && (lex.isWord || (lex.token != "==" && lex.token != "!=")))
+            return false;
+        if (lex.token == "!=")
+            op.negate = !op.negate;
+        if (!nextToken(lex) || !lex.isWord)
+            return false;
+        op.code = PRED_CONTIG;
+        op.arg = pred.contigSets.size();
+        pred.contigSets.push_back(std::vector<char>());
+        if (!isList && lex.token.find(',') != std::string::npos)
+            return false;
+        return parseContigSet(pred.contigSets.back(), lex.token, contigNames) && nextToken(lex);
+    }
+
+    // qname ~ PATTERN, qname == NAME
+    if (name == "qname")
+    {
+        if (lex.isWord || (lex.token != "~" && lex.token != "==" && lex.token != "!="))
+            return false;
+        if (lex.token == "!=")
+            op.negate = !op.negate;
+        bool isPattern = lex.token == "~";
+        if (!nextToken(lex) || !lex.isWord)
+            return false;
+        if (!isPattern && lex.token.find_first_of("*?") != std::string::npos)
+            return false;
+        op.code = PRED_QNAME;
+        op.arg = pred.strings.size();
+        pred.strings.push_back(lex.token);
+        return nextToken(lex);
+    }
+
+    // FIELD CMP NUMBER, flag & MASK
+    unsigned f = 0;
+    for (; f < 5; ++f)
+        if (name == FIELDS[f])
+            break;
+    if (f == 5 || lex.isWord)
+        return false;
+    op.field = static_cast<PredicateField>(f);
+    if (op.field == FIELD_FLAG && lex.token == "&")
+        op.code = PRED_FLAG_ANY;
+    else if (parseCmp(op.cmp, lex.token))
+        op.code = PRED_FIELD;
+    else
+        return false;
+    if (!nextToken(lex) || !lex.isWord || !parseInteger(op.value, lex.token))
+        return false;
+    return nextToken(lex);
+}
+
+// Compile a filter expression, a conjunction of terms joined by "&&", and append its ops to pred.
+// Print an error and return false if the expression is malformed.
+inline bool compileExpression(RecordPredicate & pred, std::string const & expr, StringSet<CharString> const & contigNames)
+{
+    ExpressionLexer lex(expr);
+    bool ok = nextToken(lex);
+    while (ok)
+    {
+        PredicateOp op;
+        if (!(ok = parseTerm(pred, op, lex, contigNames)))
+            break;
+        pred.ops.push_back(op);
+        if (lex.token.empty() && !lex.isWord)
+            break;
+        ok = !lex.isWord && lex.token == "&&" && nextToken(lex);
+    }
+
+    if (!ok)
+    {
+        std::cerr << "ERROR: Could not parse filter expression \'" << expr << "\' near position " << lex.pos << ".\n";
+        return false;
+    }
+    return true;
+}
+
+// Sort the ops by evaluation cost, s.t. the cheapest tests reject records first
+inline void finalizePredicate(RecordPredicate & pred)
+{
+    std::stable_sort(pred.ops.begin(), pred.ops.end(), [](PredicateOp const & a, PredicateOp const & b)
+    {
+        return a.code < b.code;
+    });
+}
+
+#endif /* PREDICATE_H_ */
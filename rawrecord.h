@@ -0,0 +1,165 @@
+#ifndef RAWRECORD_H_
+#define RAWRECORD_H_
+
+#include <seqan/bam_io.h>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace seqan;
+
+// Result of the barcode lookup of a record
+enum BarcodeStatus
+{
+    BARCODE_MISSING,
+    BARCODE_REJECTED,
+    BARCODE_WHITELISTED
+};
+
+// Whitelist slot of a record whose barcode is missing or not in the whitelist
+const uint32_t NO_SLOT = 0xffffffff;
+
+// A BAM record as stored in the file: the block_size field followed by the record data.
+// The barcode and UMI of a kept record are identified before its tags are edited, if the writer needs them.
+struct RawRecord
+{
+    char * data;
+    uint32_t length;
+    bool keep;
+    uint8_t barcode;
+    uint16_t group;         // output group of the barcode
+    uint32_t slot;          // whitelist slot of the barcode, NO_SLOT if it has none
+    uint64_t barcodeHash;   // hash of the barcode, 0 if it is missing
+    uint64_t umiHash;       // hash of the UMI with --dedup, 0 if it is missing
+    uint64_t priority;      // hash of the record with --reads_per_barcode
+};
+
+// Size of the block_size field preceding each record
+const unsigned RAW_SIZE_FIELD = 4;
+
+// Fixed-size part of the record
+inline BamAlignmentRecordCore const & core(RawRecord const & rec)
+{
+    return *reinterpret_cast<BamAlignmentRecordCore const *>(rec.data + RAW_SIZE_FIELD);
+}
+
+inline char const * qNameBegin(RawRecord const & rec)
+{
+    return rec.data + RAW_SIZE_FIELD + sizeof(BamAlignmentRecordCore);
+}
+
+inline char const * cigarBegin(RawRecord const & rec)
+{
+    return qNameBegin(rec) + core(rec)._l_qname;
+}
+
+inline char const * seqBegin(RawRecord const & rec)
+{
+    return cigarBegin(rec) + 4 * core(rec)._n_cigar;
+}
+
+inline char const * qualBegin(RawRecord const & rec)
+{
+    return seqBegin(rec) + (core(rec)._l_qseq + 1) / 2;
+}
+
+inline char const * tagsBegin(RawRecord const & rec)
+{
+    return qualBegin(rec) + core(rec)._l_qseq;
+}
+
+inline char const * tagsEnd(RawRecord const & rec)
+{
+    return rec.data + rec.length;
+}
+
+// Return the NUL terminator of a Z or H value starting at it, NULL if there is none before the end.
+// Compares 16 bytes at a time, most values end within the first block. The 16 bytes before the end
+// of the tag block are always part of the record as the tag block follows the fixed-size core.
+inline char const * findTagNul(char const * it, char const * end)
+{
+#ifdef __SSE2__
+    __m128i const zero = _mm_setzero_si128();
+    for (; end - it >= 16; it += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(it)), zero));
+        if (mask != 0)
+            return it + __builtin_ctz(mask);
+    }
+    if (it == end)
+        return NULL;
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(end - 16)), zero));
+    mask >>= 16 - (end - it);
+    return (mask == 0) ? NULL : it + __builtin_ctz(mask);
+#else
+    return static_cast<char const *>(std::memchr(it, '\0', end - it));
+#endif
+}
+
+// Skip the value of a tag of the given type, return NULL if the tag block is malformed
+inline char const * skipTagValue(char const * it, char const * end, char type)
+{
+    if (type == 'Z' || type == 'H')
+    {
+        char const * nul = findTagNul(it, end);
+        return (nul == NULL) ? NULL : nul + 1;
+    }
+    if (type == 'B')
+    {
+        if (end - it < 5)
+            return NULL;
+        int size = getBamTypeSize(it[0]);
+        int32_t count;
+        std::memcpy(&count, it + 1, sizeof(count));
+        if (size <= 0 || count < 0 || end - it - 5 < static_cast<int64_t>(size) * count)
+            return NULL;
+        return it + 5 + static_cast<int64_t>(size) * count;
+    }
+    int size = getBamTypeSize(type);
+    if (size <= 0 || end - it < size)
+        return NULL;
+    return it + size;
+}
+
+// Advance to the next tag of a raw tag block.
+// On success, key points to the 2-byte tag key, valBegin/valEnd span the value (without the NUL
+// terminator for Z/H) and type holds the type char. Return false at the end of a (malformed) block.
+inline bool nextRawTag(char const * & it, char const * end, char const * & key, char & type,
+                       char const * & valBegin, char const * & valEnd)
+{
+    if (end - it < 3)
+        return false;
+    type = it[2];
+    char const * next = skipTagValue(it + 3, end, type);
+    if (next == NULL)
+        return false;
+    key = it;
+    valBegin = it + 3;
+    valEnd = (type == 'Z' || type == 'H') ? next - 1 : next;
+    it = next;
+    return true;
+}
+
+// Locate the value of a tag in a raw tag block
+inline bool findRawTag(char const * & valBegin, char const * & valEnd, char & type,
+                       char const * it, char const * end, char const * key)
+{
+    char const * tagKey;
+    while (nextRawTag(it, end, tagKey, type, valBegin, valEnd))
+        if (tagKey[0] == key[0] && tagKey[1] == key[1])
+            return true;
+    return false;
+}
+
+// Check that the variable-length fields fit into the record
+inline bool isValidRawRecord(RawRecord const & rec)
+{
+    if (rec.length < RAW_SIZE_FIELD + sizeof(BamAlignmentRecordCore))
+        return false;
+    BamAlignmentRecordCore const & c = core(rec);
+    return c._l_qseq >= 0 && tagsBegin(rec) <= tagsEnd(rec);
+}
+
+#endif /* RAWRECORD_H_ */
@@ -0,0 +1,255 @@
+#ifndef REGIONS_H_
+#define REGIONS_H_
+
+#include <seqan/bam_io.h>
+#include <seqan/bed_io.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "pipeline.h"
+#include "rawrecord.h"
+
+using namespace seqan;
+
+// Merged, sorted and disjoint intervals of all contigs in flat arrays.
+// The intervals of contig rID are begins/ends[offsets[rID], offsets[rID + 1]).
+struct RegionIndex
+{
+    std::vector<uint32_t> offsets;
+    std::vector<int32_t> begins;
+    std::vector<int32_t> ends;
+};
+
+inline size_t numRegions(RegionIndex const & regions)
+{
+    return regions.begins.size();
+}
+
+// End position of the alignment on the reference, from the CIGAR operations consuming the reference.
+// Records without CIGAR, e.g. unmapped mates placed at their mate, cover a single position.
+inline int32_t alignmentEnd(RawRecord const & rec)
+{
+    BamAlignmentRecordCore const & c = core(rec);
+    char const * cigar = cigarBegin(rec);
+    int32_t len = 0;
+    for (unsigned i = 0; i < c._n_cigar; ++i)
+    {
+        uint32_t op;
+        std::memcpy(&op, cigar + 4 * i, 4);
+        // M, D, N, = and X consume the reference
+        if ((0x18d >> (op & 0xf)) & 1)
+            len += op >> 4;
+    }
+    return c.beginPos + std::max(len, 1);
+}
+
+// Return the first interval of contig rID ending after beginPos
+inline size_t _firstRegionAfter(RegionIndex const & regions, int32_t rID, int32_t beginPos)
+{
+    std::vector<int32_t>::const_iterator first = regions.ends.begin() + regions.offsets[rID];
+    std::vector<int32_t>::const_iterator last = regions.ends.begin() + regions.offsets[rID + 1];
+    return std::upper_bound(first, last, beginPos) - regions.ends.begin();
+}
+
+// Check if the alignment of a record overlaps any region
+inline bool overlapsRegions(RegionIndex const & regions, RawRecord const & rec)
+{
+    int32_t rID = core(rec).rID;
+    if (rID < 0 || static_cast<size_t>(rID) + 1 >= regions.offsets.size())
+        return false;
+    size_t i = _firstRegionAfter(regions, rID, core(rec).beginPos);
+    return i < regions.offsets[rID + 1] && regions.begins[i] < alignmentEnd(rec);
+}
+
+// Read the regions of a BED file, resolving contig names against the BAM header
+// Return false and print an error if the file cannot be read
+inline bool readRegions(RegionIndex & regions, CharString const & bedFileName, StringSet<CharString> const & contigNames)
+{
+    BedFileIn bedIn;
+    if (!open(bedIn, toCString(bedFileName)))
+    {
+        std::cerr << "ERROR: Could not open " << bedFileName << " for reading.\n";
+        return false;
+    }
+
+    std::unordered_map<std::string, int32_t> contigIds;
+    for (unsigned i = 0; i < length(contigNames); ++i)
+        contigIds[toCString(contigNames[i])] = i;
+
+    std::vector<std::vector<std::pair<int32_t, int32_t> > > intervals(length(contigNames));
+    size_t count = 0, unknown = 0;
+    CharString line;
+    while (!atEnd(bedIn))
+    {
+        clear(line);
+        readLine(line, bedIn.iter);
+        if (empty(line) || line[0] == '#' || startsWith(line, "track") || startsWith(line, "browser"))
+            continue;
+
+        // chrom, start and end, further columns are ignored
+        char const * chrom = toCString(line);
+        char const * tab = std::strchr(chrom, '\t');
+        char * end = NULL;
+        long beginPos = -1, endPos = -1;
+        if (tab != NULL)
+        {
+            beginPos = std::strtol(tab + 1, &end, 10);
+            if (*end == '\t')
+                endPos = std::strtol(end + 1, &end, 10);
+        }
+        if (endPos < 0 || (*end != '\0' && *end != '\t') || beginPos < 0 || endPos < beginPos ||
+            endPos > std::numeric_limits<int32_t>::max())
+        {
+            std::cerr << "ERROR: Invalid region '" << line << "' in '" << bedFileName << "'.\n";
+            return false;
+        }
+
+        ++count;
+        auto it = contigIds.find(std::string(chrom, tab));
+        if (it == contigIds.end())
+            ++unknown;
+        else if (beginPos < endPos)
+            intervals[it->second].emplace_back(beginPos, endPos);
+    }
+
+    // Merge overlapping and adjacent intervals
+    regions = RegionIndex();
+    regions.offsets.push_back(0);
+    for (std::vector<std::pair<int32_t, int32_t> > & contig : intervals)
+    {
+        std::sort(contig.begin(), contig.end());
+        size_t first = regions.begins.size();
+        for (std::pair<int32_t, int32_t> const & interval : contig)
+        {
+            if (regions.begins.size() != first && interval.first <= regions.ends.back())
+            {
+                regions.ends.back() = std::max(regions.ends.back(), interval.second);
+                continue;
+            }
+            regions.begins.push_back(interval.first);
+            regions.ends.push_back(interval.second);
+        }
+        regions.offsets.push_back(regions.begins.size());
+    }
+
+    std::cout << "\n[bcsubset] Loaded " << count << " regions from \'" << bedFileName << "\', merged into "
+              << numRegions(regions) << " intervals." << std::endl;
+    if (unknown != 0)
+        std::cerr << "WARNING: Skipped " << unknown << " regions on contigs not in the BAM header.\n";
+    return true;
+}
+
+// Smallest virtual file offset of records overlapping [beginPos, endPos) on contig rID according to the
+// index, as done by samtools. Return false if no records overlap.
+inline bool regionOffset(uint64_t & offset, BamIndex<Bai> const & index, int32_t rID, int32_t beginPos, int32_t endPos)
+{
+    if (static_cast<size_t>(rID) >= length(index._binIndices))
+        return false;
+
+    uint64_t linearMinOffset = 0;
+    unsigned window = beginPos >> 14;
+    if (!empty(index._linearIndices[rID]))
+        linearMinOffset = index._linearIndices[rID][std::min<size_t>(window, length(index._linearIndices[rID]) - 1)];
+
+    String<uint16_t> bins;
+    _baiReg2bins(bins, beginPos, endPos);
+    offset = std::numeric_limits<uint64_t>::max();
+    for (unsigned i = 0; i < length(bins); ++i)
+    {
+        auto it = index._binIndices[rID].find(bins[i]);
+        if (it == index._binIndices[rID].end())
+            continue;
+        for (unsigned j = 0; j < length(it->second.chunkBegEnds); ++j)
+            if (it->second.chunkBegEnds[j].i2 > linearMinOffset)
+                offset = std::min(offset, std::max(it->second.chunkBegEnds[j].i1, linearMinOffset));
+    }
+    return offset != std::numeric_limits<uint64_t>::max();
+}
+
+// Reads the records overlapping the regions from an indexed BAM file into batches.
+// The records of a contig are read in a single forward scan, seeking over the gaps between regions.
+struct RegionReader
+{
+    BamFileIn & inFile;
+    BamIndex<Bai> const & index;
+    RegionIndex const & regions;
+    int32_t rID;            // contig being scanned
+    size_t next;            // first region of the contig not yet reached by the scan
+    bool scanning;
+
+    RegionReader(BamFileIn & inFile, BamIndex<Bai> const & index, RegionIndex const & regions):
+        inFile(inFile), index(index), regions(regions), rID(-1), next(0), scanning(false)
+    {}
+
+    bool operator()(RecordBatch & batch);
+};
+
+// Seek to region next of the current contig unless the scan is already past its first records
+inline void _seekRegion(RegionReader & reader)
+{
+    uint64_t offset;
+    size_t last = reader.regions.offsets[reader.rID + 1];
+    for (; reader.next < last; ++reader.next)
+    {
+        if (!regionOffset(offset, reader.index, reader.rID, reader.regions.begins[reader.next],
+                          reader.regions.ends[reader.next]))
+            continue;
+        if (!reader.scanning || offset > static_cast<uint64_t>(position(reader.inFile)))
+            setPosition(reader.inFile, offset);
+        reader.scanning = true;
+        return;
+    }
+    reader.scanning = false;
+}
+
+inline bool RegionReader::operator()(RecordBatch & batch)
+{
+    while (batch.arena.used < BATCH_SIZE)
+    {
+        if (!scanning)
+        {
+            // Start the next contig with regions
+            do
+                ++rID;
+            while (static_cast<size_t>(rID) + 1 < regions.offsets.size() && regions.offsets[rID] == regions.offsets[rID + 1]);
+            if (static_cast<size_t>(rID) + 1 >= regions.offsets.size())
+                break;
+            next = regions.offsets[rID];
+            _seekRegion(*this);
+            continue;
+        }
+
+        if (atEnd(inFile))
+        {
+            scanning = false;
+            continue;
+        }
+
+        readRawRecord(batch, inFile);
+        BamAlignmentRecordCore const & c = core(batch.records.back());
+        if (c.rID != rID)
+        {
+            dropLastRecord(batch);
+            scanning = false;
+            continue;
+        }
+
+        // Skip the regions ending before the record, all further records start behind them
+        size_t first = _firstRegionAfter(regions, rID, c.beginPos);
+        if (!overlapsRegions(regions, batch.records.back()))
+            dropLastRecord(batch);
+        if (first != next)
+        {
+            next = first;
+            _seekRegion(*this);
+        }
+    }
+    return !batch.records.empty();
+}
+
+#endif /* REGIONS_H_ */
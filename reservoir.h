@@ -0,0 +1,388 @@
+#ifndef RESERVOIR_H_
+#define RESERVOIR_H_
+
+#include <seqan/bam_io.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "barcode.h"
+#include "bgzf.h"
+#include "rawrecord.h"
+#include "whitelist.h"
+
+using namespace seqan;
+
+// Reservoir of a whitelist slot before its first record
+const uint32_t NO_RESERVOIR = 0xffffffff;
+
+// Arena offset of a sampled record that was written to a run
+const uint64_t RESERVOIR_SPILLED = ~static_cast<uint64_t>(0);
+
+// Bytes of a run collected before they are compressed
+const size_t RUN_CHUNK_SIZE = 1 << 20;
+
+// Entries of a reservoir heap when it first grows
+const size_t MIN_HEAP_CAPACITY = 4;
+
+// A sampled record: its priority, its number among the passed records and the offset of its output group and bytes
+// in the arena
+struct ReservoirEntry
+{
+    uint64_t priority;
+    uint64_t ordinal;
+    uint64_t offset;
+};
+
+// Header of a record in a run
+struct RunRecordHeader
+{
+    uint64_t ordinal;
+    uint32_t reservoir;
+    uint16_t group;
+};
+
+// Temporary BGZF file of spilled records in output order, read back one record at a time
+struct ReservoirRun
+{
+    std::FILE * file;
+    std::vector<char> block;
+    std::vector<char> data;         // inflated data from pos on
+    size_t pos;
+    RunRecordHeader head;           // record at pos, if valid
+    bool valid;
+    bool consumed;                  // the record at pos was returned, move past it on the next call
+};
+
+// Uniform sample of k passed records per barcode. Each record gets a priority by hashing its bytes before its tags
+// are edited, and the reservoir of a barcode is a max-heap of the k records with the smallest priorities, so the
+// sample does not depend on the order of the records or the number of threads.
+// The heap of a barcode doubles as its records come in, up to k entries, and the records are copied into one arena.
+// The heaps count against the memory budget, but leave at least half of it to the arena. When the arena outgrows its
+// share, it is compacted if replaced records take half of it, otherwise its records are written to a temporary BGZF run
+// in output order. At the end the runs are merged with the records left in the arena.
+struct ReservoirSample
+{
+    Whitelist const & wl;
+    BarcodeSpec const & bcSpec;
+    unsigned k;
+    uint64_t seed;
+    bool barcodeOrder;                      // write the records by barcode instead of in input order
+    size_t memoryBudget;                    // bytes of the heaps and the arena
+
+    std::vector<uint32_t> slotReservoirs;   // reservoir of each whitelist slot
+    std::unordered_map<uint64_t, uint32_t> otherReservoirs;     // by barcode hash, for barcodes kept by -x only
+    std::vector<std::string> barcodes;      // barcode of each reservoir
+    std::vector<std::vector<ReservoirEntry> > heaps;    // up to k entries per reservoir
+    size_t heapBytes;                       // bytes allocated by the heaps
+    std::vector<char> arena;
+    size_t garbage;                         // bytes of replaced records in the arena
+    std::vector<ReservoirRun> runs;
+    uint64_t numRecords;
+    uint64_t numSpilled;
+
+    // Output order of the records in the arena, by reservoir and entry, and the ordinals of the sampled records in
+    // the runs
+    std::vector<std::pair<uint32_t, uint32_t> > arenaOrder;
+    size_t arenaPos;
+    std::vector<uint64_t> spilledOrdinals;
+
+    ReservoirSample(Whitelist const & wl, BarcodeSpec const & bcSpec, unsigned k, uint64_t seed, bool barcodeOrder,
+                    size_t memoryBudget):
+        wl(wl), bcSpec(bcSpec), k(k), seed(seed), barcodeOrder(barcodeOrder), memoryBudget(memoryBudget),
+        slotReservoirs(wl.slots.size(), NO_RESERVOIR), heapBytes(0), garbage(0), numRecords(0), numSpilled(0),
+        arenaPos(0) {}
+
+    ReservoirSample(ReservoirSample const &) = delete;
+    ReservoirSample & operator=(ReservoirSample const &) = delete;
+
+    ~ReservoirSample()
+    {
+        for (ReservoirRun & run : runs)
+            std::fclose(run.file);
+    }
+};
+
+inline bool _higherPriority(ReservoirEntry const & a, ReservoirEntry const & b)
+{
+    return a.priority < b.priority;
+}
+
+inline uint32_t _newReservoir(ReservoirSample & sample, std::string const & barcode)
+{
+    sample.barcodes.push_back(barcode);
+    sample.heaps.push_back(std::vector<ReservoirEntry>());
+    return sample.heaps.size() - 1;
+}
+
+// Reservoir of the barcode of a record by its whitelist slot, or by its barcode hash for barcodes missing from the
+// table. Both were taken before the tags were edited. Records without a barcode share one reservoir.
+inline uint32_t _reservoirOf(ReservoirSample & sample, RawRecord const & rec)
+{
+    if (rec.slot != NO_SLOT)
+    {
+        uint32_t & reservoir = sample.slotReservoirs[rec.slot];
+        if (reservoir == NO_RESERVOIR)
+        {
+            WhitelistSlot const & s = sample.wl.slots[rec.slot];
+            reservoir = _newReservoir(sample, std::string(&sample.wl.keys[s.offset], s.length));
+        }
+        return reservoir;
+    }
+    auto it = sample.otherReservoirs.find(rec.barcodeHash);
+    if (it == sample.otherReservoirs.end())
+    {
+        // The name of a barcode missing from the table is only used to order the output, see bamSubset()
+        BarcodeKey key;
+        std::string barcode = (rec.barcodeHash != 0 && getBarcodeKey(key, rec, sample.bcSpec)) ? keyString(key) : "*";
+        it = sample.otherReservoirs.emplace(rec.barcodeHash, _newReservoir(sample, barcode)).first;
+    }
+    return it->second;
+}
+
+inline uint32_t _arenaLength(ReservoirSample const & sample, uint64_t offset)
+{
+    int32_t recordLen;
+    std::memcpy(&recordLen, &sample.arena[offset + sizeof(uint16_t)], RAW_SIZE_FIELD);
+    return sizeof(uint16_t) + RAW_SIZE_FIELD + recordLen;
+}
+
+// Whether the record with the ordinal in reservoir a is written before the one in reservoir b
+inline bool _sampleBefore(ReservoirSample const & sample, uint32_t a, uint64_t ordinalA, uint32_t b, uint64_t ordinalB)
+{
+    if (sample.barcodeOrder && a != b)
+        return sample.barcodes[a] < sample.barcodes[b];
+    return ordinalA < ordinalB;
+}
+
+// Entries of the records in the arena, in output order
+inline void _arenaOrder(std::vector<std::pair<uint32_t, uint32_t> > & order, ReservoirSample const & sample)
+{
+    order.clear();
+    for (uint32_t r = 0; r < sample.heaps.size(); ++r)
+        for (uint32_t i = 0; i < sample.heaps[r].size(); ++i)
+            if (sample.heaps[r][i].offset != RESERVOIR_SPILLED)
+                order.push_back(std::make_pair(r, i));
+    std::sort(order.begin(), order.end(),
+              [&sample](std::pair<uint32_t, uint32_t> const & a, std::pair<uint32_t, uint32_t> const & b)
+    {
+        return _sampleBefore(sample, a.first, sample.heaps[a.first][a.second].ordinal,
+                             b.first, sample.heaps[b.first][b.second].ordinal);
+    });
+}
+
+inline void _writeRun(std::FILE * file, std::vector<char> & chunk, std::vector<char> & compressed)
+{
+    compressed.clear();
+    deflateBgzfBlocks(compressed, chunk.data(), chunk.size());
+    if (std::fwrite(compressed.data(), 1, compressed.size(), file) != compressed.size())
+        SEQAN_THROW(IOError("Could not write to temporary file for sampled records."));
+    chunk.clear();
+}
+
+// Write the records of the arena to a new run and empty the arena
+inline void _spillSample(ReservoirSample & sample)
+{
+    ReservoirRun run = ReservoirRun();
+    if ((run.file = std::tmpfile()) == NULL)
+        SEQAN_THROW(IOError("Could not create temporary file for sampled records."));
+    sample.runs.push_back(run);
+
+    std::vector<std::pair<uint32_t, uint32_t> > order;
+    _arenaOrder(order, sample);
+    std::vector<char> chunk;
+    std::vector<char> compressed;
+    for (std::pair<uint32_t, uint32_t> const & i : order)
+    {
+        ReservoirEntry & entry = sample.heaps[i.first][i.second];
+        RunRecordHeader header = RunRecordHeader();
+        header.ordinal = entry.ordinal;
+        header.reservoir = i.first;
+        std::memcpy(&header.group, &sample.arena[entry.offset], sizeof(uint16_t));
+        uint32_t length = _arenaLength(sample, entry.offset) - sizeof(uint16_t);
+        chunk.insert(chunk.end(), reinterpret_cast<char const *>(&header),
+                     reinterpret_cast<char const *>(&header) + sizeof(header));
+        chunk.insert(chunk.end(), &sample.arena[entry.offset + sizeof(uint16_t)],
+                     &sample.arena[entry.offset + sizeof(uint16_t)] + length);
+        if (chunk.size() >= RUN_CHUNK_SIZE)
+            _writeRun(run.file, chunk, compressed);
+        entry.offset = RESERVOIR_SPILLED;
+    }
+    _writeRun(run.file, chunk, compressed);
+    sample.numSpilled += order.size();
+    sample.arena.clear();
+    sample.garbage = 0;
+}
+
+// Move the records of the arena together, dropping the replaced ones
+inline void _compactSample(ReservoirSample & sample)
+{
+    std::vector<char> arena;
+    arena.reserve(sample.arena.size() - sample.garbage);
+    for (std::vector<ReservoirEntry> & heap : sample.heaps)
+        for (ReservoirEntry & entry : heap)
+        {
+            if (entry.offset == RESERVOIR_SPILLED)
+                continue;
+            uint32_t length = _arenaLength(sample, entry.offset);
+            arena.insert(arena.end(), &sample.arena[entry.offset], &sample.arena[entry.offset] + length);
+            entry.offset = arena.size() - length;
+        }
+    sample.arena.swap(arena);
+    sample.garbage = 0;
+}
+
+// Add a passed record to the reservoir of its barcode if its priority is among the k smallest
+inline void sampleRecord(ReservoirSample & sample, RawRecord const & rec)
+{
+    uint32_t r = _reservoirOf(sample, rec);
+    ReservoirEntry entry = {rec.priority, sample.numRecords++, sample.arena.size()};
+    std::vector<ReservoirEntry> & heap = sample.heaps[r];
+    if (heap.size() == sample.k)
+    {
+        if (!_higherPriority(entry, heap.front()))
+            return;
+        std::pop_heap(heap.begin(), heap.end(), _higherPriority);
+        if (heap.back().offset != RESERVOIR_SPILLED)
+            sample.garbage += _arenaLength(sample, heap.back().offset);
+        heap.pop_back();
+    }
+    else if (heap.size() == heap.capacity())
+    {
+        size_t capacity = heap.capacity();
+        heap.reserve(std::min<size_t>(sample.k, std::max(MIN_HEAP_CAPACITY, 2 * capacity)));
+        sample.heapBytes += (heap.capacity() - capacity) * sizeof(ReservoirEntry);
+    }
+    heap.push_back(entry);
+    std::push_heap(heap.begin(), heap.end(), _higherPriority);
+
+    char const * group = reinterpret_cast<char const *>(&rec.group);
+    sample.arena.insert(sample.arena.end(), group, group + sizeof(uint16_t));
+    sample.arena.insert(sample.arena.end(), rec.data, rec.data + rec.length);
+    size_t arenaBudget = (sample.heapBytes < sample.memoryBudget / 2) ? sample.memoryBudget - sample.heapBytes
+                                                                       : sample.memoryBudget / 2;
+    if (sample.arena.size() > arenaBudget)
+    {
+        if (sample.garbage * 2 >= sample.arena.size())
+            _compactSample(sample);
+        else
+            _spillSample(sample);
+    }
+}
+
+// Make sure the data of the run holds n bytes from pos on, return false at its end
+inline bool _loadRun(ReservoirRun & run, size_t n)
+{
+    if (run.data.size() - run.pos >= n)
+        return true;
+    run.data.erase(run.data.begin(), run.data.begin() + run.pos);
+    run.pos = 0;
+    while (run.data.size() < n)
+    {
+        if (!readNextBgzfBlock(run.block, run.file))
+        {
+            if (!run.block.empty())
+                SEQAN_THROW(IOError("Could not read temporary file for sampled records."));
+            return false;
+        }
+        if (!inflateBgzfBlock(run.data, run.block.data(), run.block.size()))
+            SEQAN_THROW(IOError("Corrupt temporary file for sampled records."));
+    }
+    return true;
+}
+
+inline uint32_t _runRecordLength(ReservoirRun const & run)
+{
+    int32_t recordLen;
+    std::memcpy(&recordLen, &run.data[run.pos + sizeof(RunRecordHeader)], RAW_SIZE_FIELD);
+    return RAW_SIZE_FIELD + recordLen;
+}
+
+// Move to the next record of the run that is still in the sample
+inline void _nextRunRecord(ReservoirSample const & sample, ReservoirRun & run)
+{
+    if (run.valid)
+        run.pos += sizeof(RunRecordHeader) + _runRecordLength(run);
+    while ((run.valid = _loadRun(run, sizeof(RunRecordHeader) + RAW_SIZE_FIELD)))
+    {
+        std::memcpy(&run.head, &run.data[run.pos], sizeof(RunRecordHeader));
+        if (!_loadRun(run, sizeof(RunRecordHeader) + _runRecordLength(run)))
+            SEQAN_THROW(IOError("Truncated temporary file for sampled records."));
+        if (std::binary_search(sample.spilledOrdinals.begin(), sample.spilledOrdinals.end(), run.head.ordinal))
+            return;
+        run.pos += sizeof(RunRecordHeader) + _runRecordLength(run);
+    }
+}
+
+// Prepare writing the sampled records, merging the runs with the arena
+inline void startSampleOutput(ReservoirSample & sample)
+{
+    _arenaOrder(sample.arenaOrder, sample);
+    sample.arenaPos = 0;
+    sample.spilledOrdinals.clear();
+    for (std::vector<ReservoirEntry> const & heap : sample.heaps)
+        for (ReservoirEntry const & entry : heap)
+            if (entry.offset == RESERVOIR_SPILLED)
+                sample.spilledOrdinals.push_back(entry.ordinal);
+    std::sort(sample.spilledOrdinals.begin(), sample.spilledOrdinals.end());
+    for (ReservoirRun & run : sample.runs)
+    {
+        std::rewind(run.file);
+        run.data.clear();
+        run.pos = 0;
+        run.valid = false;
+        run.consumed = false;
+        _nextRunRecord(sample, run);
+    }
+}
+
+// Get the next sampled record in output order, valid until the next call. Return false after the last one.
+inline bool nextSampledRecord(RawRecord & rec, ReservoirSample & sample)
+{
+    // Find the first of the heads of the runs and the arena
+    ReservoirRun * first = NULL;
+    for (ReservoirRun & run : sample.runs)
+    {
+        if (run.consumed)
+        {
+            run.consumed = false;
+            _nextRunRecord(sample, run);
+        }
+        if (run.valid && (first == NULL ||
+                          _sampleBefore(sample, run.head.reservoir, run.head.ordinal, first->head.reservoir,
+                                        first->head.ordinal)))
+            first = &run;
+    }
+    if (sample.arenaPos < sample.arenaOrder.size())
+    {
+        std::pair<uint32_t, uint32_t> i = sample.arenaOrder[sample.arenaPos];
+        ReservoirEntry const & entry = sample.heaps[i.first][i.second];
+        if (first == NULL ||
+            _sampleBefore(sample, i.first, entry.ordinal, first->head.reservoir, first->head.ordinal))
+        {
+            ++sample.arenaPos;
+            rec.data = &sample.arena[entry.offset + sizeof(uint16_t)];
+            rec.length = _arenaLength(sample, entry.offset) - sizeof(uint16_t);
+            rec.keep = true;
+            rec.barcode = BARCODE_MISSING;
+            std::memcpy(&rec.group, &sample.arena[entry.offset], sizeof(uint16_t));
+            return true;
+        }
+    }
+    if (first == NULL)
+        return false;
+
+    // The record stays in the data of the run until the run moves past it on the next call
+    rec.data = &first->data[first->pos + sizeof(RunRecordHeader)];
+    rec.length = _runRecordLength(*first);
+    rec.keep = true;
+    rec.barcode = BARCODE_MISSING;
+    rec.group = first->head.group;
+    first->consumed = true;
+    return true;
+}
+
+#endif /* RESERVOIR_H_ */
@@ -0,0 +1,229 @@
+#ifndef SAMFORMAT_H_
+#define SAMFORMAT_H_
+
+#include <seqan/bam_io.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "bufferpool.h"
+#include "rawrecord.h"
+#include "seqcodec.h"
+
+using namespace seqan;
+
+// Lookup tables for formatting raw records as SAM text
+struct SamTables
+{
+    char digitPairs[200];       // "00" to "99"
+
+    SamTables()
+    {
+        for (unsigned i = 0; i < 100; ++i)
+        {
+            digitPairs[2 * i] = '0' + i / 10;
+            digitPairs[2 * i + 1] = '0' + i % 10;
+        }
+    }
+};
+
+inline SamTables const & samTables()
+{
+    static SamTables const tables;
+    return tables;
+}
+
+// Write the decimal representation of x, return the end of the written characters
+inline char * formatUnsigned(char * out, uint64_t x)
+{
+    char tmp[20];
+    char * end = tmp + sizeof(tmp);
+    char * it = end;
+    char const * pairs = samTables().digitPairs;
+    while (x >= 100)
+    {
+        it -= 2;
+        std::memcpy(it, pairs + 2 * (x % 100), 2);
+        x /= 100;
+    }
+    if (x >= 10)
+    {
+        it -= 2;
+        std::memcpy(it, pairs + 2 * x, 2);
+    }
+    else
+    {
+        *--it = '0' + x;
+    }
+    std::memcpy(out, it, end - it);
+    return out + (end - it);
+}
+
+inline char * formatInteger(char * out, int64_t x)
+{
+    if (x < 0)
+    {
+        *out++ = '-';
+        return formatUnsigned(out, -static_cast<uint64_t>(x));
+    }
+    return formatUnsigned(out, x);
+}
+
+inline char * formatString(char * out, char const * str, size_t len)
+{
+    std::memcpy(out, str, len);
+    return out + len;
+}
+
+inline char * formatContig(char * out, int32_t rID, StringSet<CharString> const & contigNames)
+{
+    if (rID < 0 || static_cast<size_t>(rID) >= length(contigNames))
+    {
+        *out++ = '*';
+        return out;
+    }
+    return formatString(out, begin(contigNames[rID], Standard()), length(contigNames[rID]));
+}
+
+// Format a single element of a numeric tag value of the given type
+inline char * formatTagNumber(char * out, char type, char const * val)
+{
+    switch (type)
+    {
+        case 'c': { int8_t v; std::memcpy(&v, val, 1); return formatInteger(out, v); }
+        case 'C': { uint8_t v; std::memcpy(&v, val, 1); return formatUnsigned(out, v); }
+        case 's': { int16_t v; std::memcpy(&v, val, 2); return formatInteger(out, v); }
+        case 'S': { uint16_t v; std::memcpy(&v, val, 2); return formatUnsigned(out, v); }
+        case 'i': { int32_t v; std::memcpy(&v, val, 4); return formatInteger(out, v); }
+        case 'I': { uint32_t v; std::memcpy(&v, val, 4); return formatUnsigned(out, v); }
+        default:  { float v; std::memcpy(&v, val, 4); return out + std::sprintf(out, "%g", v); }
+    }
+}
+
+// Upper bound of the length of the SAM line of a record.
+// Every byte of the record expands to at most 5 characters ("-128," for a B:c array element).
+inline size_t samLineBound(RawRecord const & rec, size_t maxContigLength)
+{
+    return 5 * static_cast<size_t>(rec.length) + 2 * maxContigLength + 128;
+}
+
+// Append the SAM line of a raw record to the buffer
+inline void appendSamRecord(TextBuffer & buffer, RawRecord const & rec, StringSet<CharString> const & contigNames,
+                            size_t maxContigLength)
+{
+    BamAlignmentRecordCore const & c = core(rec);
+    char * const start = reserveText(buffer, samLineBound(rec, maxContigLength));
+    char * out = start;
+
+    out = formatString(out, qNameBegin(rec), c._l_qname - 1);
+    *out++ = '\t';
+    out = formatUnsigned(out, c.flag);
+    *out++ = '\t';
+    out = formatContig(out, c.rID, contigNames);
+    *out++ = '\t';
+    out = formatInteger(out, static_cast<int64_t>(c.beginPos) + 1);
+    *out++ = '\t';
+    out = formatUnsigned(out, c.mapQ);
+    *out++ = '\t';
+
+    // CIGAR
+    if (c._n_cigar == 0)
+        *out++ = '*';
+    char const * cigar = cigarBegin(rec);
+    for (unsigned i = 0; i < c._n_cigar; ++i)
+    {
+        uint32_t op;
+        std::memcpy(&op, cigar + 4 * i, 4);
+        out = formatUnsigned(out, op >> 4);
+        *out++ = "MIDNSHP=X???????"[op & 0xf];
+    }
+    *out++ = '\t';
+
+    // Mate
+    if (c.rNextId >= 0 && c.rNextId == c.rID)
+        *out++ = '=';
+    else
+        out = formatContig(out, c.rNextId, contigNames);
+    *out++ = '\t';
+    out = formatInteger(out, static_cast<int64_t>(c.pNext) + 1);
+    *out++ = '\t';
+    out = formatInteger(out, c.tLen);
+    *out++ = '\t';
+
+    // Sequence, two bases per byte
+    if (c._l_qseq == 0)
+        *out++ = '*';
+    decodeBases(out, seqBegin(rec), c._l_qseq);
+    out += c._l_qseq;
+    *out++ = '\t';
+
+    // Qualities
+    char const * qual = qualBegin(rec);
+    if (c._l_qseq == 0 || static_cast<unsigned char>(qual[0]) == 0xff)
+        *out++ = '*';
+    else
+    {
+        offsetQualities(out, qual, c._l_qseq, 33);
+        out += c._l_qseq;
+    }
+
+    // Tags
+    char const * it = tagsBegin(rec);
+    char const * key;
+    char const * valBegin;
+    char const * valEnd;
+    char type;
+    while (nextRawTag(it, tagsEnd(rec), key, type, valBegin, valEnd))
+    {
+        *out++ = '\t';
+        *out++ = key[0];
+        *out++ = key[1];
+        *out++ = ':';
+        switch (type)
+        {
+            case 'A':
+                out = formatString(out, "A:", 2);
+                *out++ = *valBegin;
+                break;
+            case 'Z':
+            case 'H':
+                *out++ = type;
+                *out++ = ':';
+                out = formatString(out, valBegin, valEnd - valBegin);
+                break;
+            case 'B':
+            {
+                char subType = valBegin[0];
+                int size = getBamTypeSize(subType);
+                out = formatString(out, "B:", 2);
+                *out++ = subType;
+                for (char const * elem = valBegin + 5; elem < valEnd; elem += size)
+                {
+                    *out++ = ',';
+                    out = formatTagNumber(out, subType, elem);
+                }
+                break;
+            }
+            case 'f':
+                out = formatString(out, "f:", 2);
+                out = formatTagNumber(out, type, valBegin);
+                break;
+            default:
+                out = formatString(out, "i:", 2);
+                out = formatTagNumber(out, type, valBegin);
+                break;
+        }
+    }
+    *out++ = '\n';
+    buffer.size += out - start;
+}
+
+// Longest contig name, bounds the SAM line lengths
+inline size_t maxContigLength(StringSet<CharString> const & contigNames)
+{
+    size_t len = 1;
+    for (unsigned i = 0; i < length(contigNames); ++i)
+        len = std::max(len, static_cast<size_t>(length(contigNames[i])));
+    return len;
+}
+
+#endif /* SAMFORMAT_H_ */
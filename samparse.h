@@ -0,0 +1,361 @@
+#ifndef SAMPARSE_H_
+#define SAMPARSE_H_
+
+#include <seqan/bam_io.h>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bufferpool.h"
+#include "pipeline.h"
+#include "rawrecord.h"
+#include "regions.h"
+#include "seqcodec.h"
+
+using namespace seqan;
+
+// Reads SAM text in newline-aligned chunks of about BATCH_SIZE bytes.
+// The lines are parsed into raw records by the filter threads, see parseSamBatch().
+struct SamReader
+{
+    BamFileIn & inFile;
+    std::vector<char> carry;    // incomplete last line of the previous chunk
+
+    bool operator()(RecordBatch & batch);
+};
+
+inline bool SamReader::operator()(RecordBatch & batch)
+{
+    TextBuffer & lines = batch.lines;
+    if (!carry.empty())
+    {
+        std::memcpy(reserveText(lines, carry.size()), &carry[0], carry.size());
+        lines.size += carry.size();
+        carry.clear();
+    }
+
+    // The stream iterator has no buffer of its own, so the stream buffer continues after the header
+    std::streambuf & buf = *inFile.stream.rdbuf();
+    while (true)
+    {
+        char * ptr = reserveText(lines, BATCH_SIZE);
+        std::streamsize n = buf.sgetn(ptr, BATCH_SIZE);
+        lines.size += n;
+        if (n < static_cast<std::streamsize>(BATCH_SIZE))
+            break;
+
+        // Keep the incomplete last line for the next chunk
+        size_t end = lines.size;
+        while (end > lines.size - n && lines.data[end - 1] != '\n')
+            --end;
+        if (end > lines.size - n)
+        {
+            carry.assign(lines.data.begin() + end, lines.data.begin() + lines.size);
+            lines.size = end;
+            break;
+        }
+    }
+
+    if (lines.size != 0 && lines.data[lines.size - 1] != '\n')
+    {
+        *reserveText(lines, 1) = '\n';
+        ++lines.size;
+    }
+    return lines.size != 0;
+}
+
+// Reference ids of the contig names, shared by all filter threads
+struct SamParser
+{
+    std::unordered_map<std::string, int32_t> contigIds;
+};
+
+inline void initSamParser(SamParser & parser, StringSet<CharString> const & contigNames)
+{
+    for (unsigned i = 0; i < length(contigNames); ++i)
+        parser.contigIds[toCString(contigNames[i])] = i;
+}
+
+// Parse a decimal integer spanning exactly [it, end)
+inline bool parseSamInteger(int64_t & value, char const * it, char const * end)
+{
+    bool negative = (it != end && *it == '-');
+    if (negative || (it != end && *it == '+'))
+        ++it;
+    if (it == end || end - it > 18)
+        return false;
+    value = 0;
+    for (; it != end; ++it)
+    {
+        if (*it < '0' || *it > '9')
+            return false;
+        value = value * 10 + (*it - '0');
+    }
+    if (negative)
+        value = -value;
+    return true;
+}
+
+inline int32_t samContigId(SamParser const & parser, std::string & name, char const * it, char const * end)
+{
+    if (end - it == 1 && *it == '*')
+        return -1;
+    name.assign(it, end);
+    auto found = parser.contigIds.find(name);
+    if (found == parser.contigIds.end())
+        SEQAN_THROW(ParseError("Unknown reference name in SAM record."));
+    return found->second;
+}
+
+template <typename TValue>
+inline char * putValue(char * out, TValue value)
+{
+    std::memcpy(out, &value, sizeof(TValue));
+    return out + sizeof(TValue);
+}
+
+// Smallest BAM integer type holding value, as chosen by samtools
+inline char integerTagType(int64_t value)
+{
+    if (value < 0)
+        return (value >= -128) ? 'c' : (value >= -32768) ? 's' : 'i';
+    return (value <= 255) ? 'C' : (value <= 65535) ? 'S' : 'I';
+}
+
+inline char * putNumber(char * out, char type, char const * it, char const * end)
+{
+    if (type == 'f')
+    {
+        char * parsed;
+        float value = std::strtof(it, &parsed);
+        if (parsed != end)
+            SEQAN_THROW(ParseError("Invalid float value in SAM record."));
+        return putValue(out, value);
+    }
+    int64_t value;
+    if (!parseSamInteger(value, it, end))
+        SEQAN_THROW(ParseError("Invalid integer value in SAM record."));
+    switch (type)
+    {
+        case 'c': return putValue(out, static_cast<int8_t>(value));
+        case 'C': return putValue(out, static_cast<uint8_t>(value));
+        case 's': return putValue(out, static_cast<int16_t>(value));
+        case 'S': return putValue(out, static_cast<uint16_t>(value));
+        case 'i': return putValue(out, static_cast<int32_t>(value));
+        default:  return putValue(out, static_cast<uint32_t>(value));
+    }
+}
+
+// Encode the tag field KEY:TYPE:VALUE in BAM format
+inline char * putSamTag(char * out, char const * it, char const * end)
+{
+    if (end - it < 5 || it[2] != ':' || it[4] != ':')
+        SEQAN_THROW(ParseError("Invalid tag in SAM record."));
+    char type = it[3];
+    char const * val = it + 5;
+    *out++ = it[0];
+    *out++ = it[1];
+    switch (type)
+    {
+        case 'A':
+            if (end - val != 1)
+                SEQAN_THROW(ParseError("Invalid character tag in SAM record."));
+            *out++ = 'A';
+            *out++ = *val;
+            return out;
+        case 'Z':
+        case 'H':
+            *out++ = type;
+            std::memcpy(out, val, end - val);
+            out += end - val;
+            *out++ = '\0';
+            return out;
+        case 'f':
+            *out++ = 'f';
+            return putNumber(out, 'f', val, end);
+        case 'i':
+        {
+            int64_t value;
+            if (!parseSamInteger(value, val, end) || value < std::numeric_limits<int32_t>::min() ||
+                value > std::numeric_limits<uint32_t>::max())
+                SEQAN_THROW(ParseError("Invalid integer tag in SAM record."));
+            *out++ = integerTagType(value);
+            return putNumber(out, out[-1], val, end);
+        }
+        case 'B':
+        {
+            if (val == end || getBamTypeSize(*val) <= 0)
+                SEQAN_THROW(ParseError("Invalid array tag in SAM record."));
+            char subType = *val++;
+            *out++ = 'B';
+            *out++ = subType;
+            char * countPtr = out;
+            out += 4;
+            int32_t count = 0;
+            while (val != end)
+            {
+                if (*val++ != ',')
+                    SEQAN_THROW(ParseError("Invalid array tag in SAM record."));
+                char const * comma = static_cast<char const *>(std::memchr(val, ',', end - val));
+                char const * elemEnd = (comma == NULL) ? end : comma;
+                out = putNumber(out, subType, val, elemEnd);
+                val = elemEnd;
+                ++count;
+            }
+            putValue(countPtr, count);
+            return out;
+        }
+        default:
+            SEQAN_THROW(ParseError("Unknown tag type in SAM record."));
+    }
+    return out;
+}
+
+// Parse a SAM line (without the newline) into a raw record appended to the batch.
+// A raw record takes at most twice the bytes of its SAM line plus the fixed-size fields.
+inline void parseSamLine(RecordBatch & batch, SamParser const & parser, std::string & name, char const * line, char const * end)
+{
+    char const * fields[11];
+    char const * fieldEnds[11];
+    char const * it = line;
+    for (unsigned i = 0; i < 11; ++i)
+    {
+        if (it > end)
+            SEQAN_THROW(ParseError("SAM record with less than 11 fields."));
+        char const * tab = static_cast<char const *>(std::memchr(it, '\t', end - it));
+        fields[i] = it;
+        fieldEnds[i] = (tab == NULL) ? end : tab;
+        it = fieldEnds[i] + 1;
+    }
+
+    size_t bound = RAW_SIZE_FIELD + sizeof(BamAlignmentRecordCore) + 2 * (end - line) + 8;
+    char * data = allocate(batch.arena, (bound + 7) & ~static_cast<size_t>(7));
+
+    BamAlignmentRecordCore c;
+    int64_t value;
+    if (fieldEnds[0] - fields[0] > 254)
+        SEQAN_THROW(ParseError("Read name too long in SAM record."));
+    c._l_qname = fieldEnds[0] - fields[0] + 1;
+    if (!parseSamInteger(value, fields[1], fieldEnds[1]) || value < 0 || value > 0xffff)
+        SEQAN_THROW(ParseError("Invalid flag in SAM record."));
+    c.flag = value;
+    c.rID = samContigId(parser, name, fields[2], fieldEnds[2]);
+    if (!parseSamInteger(value, fields[3], fieldEnds[3]))
+        SEQAN_THROW(ParseError("Invalid position in SAM record."));
+    c.beginPos = value - 1;
+    if (!parseSamInteger(value, fields[4], fieldEnds[4]) || value < 0 || value > 255)
+        SEQAN_THROW(ParseError("Invalid mapping quality in SAM record."));
+    c.mapQ = value;
+    if (fieldEnds[6] - fields[6] == 1 && *fields[6] == '=')
+        c.rNextId = c.rID;
+    else
+        c.rNextId = samContigId(parser, name, fields[6], fieldEnds[6]);
+    if (!parseSamInteger(value, fields[7], fieldEnds[7]))
+        SEQAN_THROW(ParseError("Invalid mate position in SAM record."));
+    c.pNext = value - 1;
+    if (!parseSamInteger(value, fields[8], fieldEnds[8]))
+        SEQAN_THROW(ParseError("Invalid template length in SAM record."));
+    c.tLen = value;
+
+    // Read name
+    char * out = data + RAW_SIZE_FIELD + sizeof(BamAlignmentRecordCore);
+    std::memcpy(out, fields[0], c._l_qname - 1);
+    out += c._l_qname - 1;
+    *out++ = '\0';
+
+    // CIGAR
+    c._n_cigar = 0;
+    if (!(fieldEnds[5] - fields[5] == 1 && *fields[5] == '*'))
+    {
+        uint32_t len = 0;
+        bool hasLen = false;
+        for (char const * op = fields[5]; op != fieldEnds[5]; ++op)
+        {
+            if (*op >= '0' && *op <= '9')
+            {
+                len = len * 10 + (*op - '0');
+                hasLen = true;
+                continue;
+            }
+            char const * opChar = static_cast<char const *>(std::memchr("MIDNSHP=X", *op, 9));
+            if (opChar == NULL || *op == '\0' || !hasLen || len >= (1u << 28))
+                SEQAN_THROW(ParseError("Invalid CIGAR in SAM record."));
+            out = putValue(out, (len << 4) | static_cast<uint32_t>(opChar - "MIDNSHP=X"));
+            ++c._n_cigar;
+            len = 0;
+            hasLen = false;
+        }
+        if (hasLen)
+            SEQAN_THROW(ParseError("Invalid CIGAR in SAM record."));
+    }
+
+    // Sequence, two bases per byte
+    c._l_qseq = 0;
+    if (!(fieldEnds[9] - fields[9] == 1 && *fields[9] == '*'))
+    {
+        c._l_qseq = fieldEnds[9] - fields[9];
+        encodeBases(out, fields[9], c._l_qseq);
+        out += (c._l_qseq + 1) / 2;
+    }
+
+    // Qualities
+    if (fieldEnds[10] - fields[10] == 1 && *fields[10] == '*')
+    {
+        std::memset(out, 0xff, c._l_qseq);
+    }
+    else
+    {
+        if (fieldEnds[10] - fields[10] != c._l_qseq)
+            SEQAN_THROW(ParseError("Sequence and qualities differ in length in SAM record."));
+        offsetQualities(out, fields[10], c._l_qseq, -33);
+    }
+    out += c._l_qseq;
+
+    // Tags
+    for (it = fieldEnds[10]; it < end; )
+    {
+        char const * tagBegin = it + 1;
+        char const * tab = static_cast<char const *>(std::memchr(tagBegin, '\t', end - tagBegin));
+        it = (tab == NULL) ? end : tab;
+        if (it != tagBegin)
+            out = putSamTag(out, tagBegin, it);
+    }
+
+    RawRecord rec;
+    rec.data = data;
+    rec.length = out - data;
+    rec.keep = false;
+    rec.barcode = BARCODE_MISSING;
+    rec.group = 0;
+    int32_t recordLen = rec.length - RAW_SIZE_FIELD;
+    std::memcpy(data, &recordLen, RAW_SIZE_FIELD);
+
+    c.bin = 4680;
+    std::memcpy(data + RAW_SIZE_FIELD, &c, sizeof(c));
+    if (c.beginPos >= 0)
+        c.bin = _reg2Bin(c.beginPos, (c.flag & BAM_FLAG_UNMAPPED) ? c.beginPos + 1 : alignmentEnd(rec));
+    std::memcpy(data + RAW_SIZE_FIELD, &c, sizeof(c));
+
+    shrinkLast(batch.arena, data, (bound + 7) & ~static_cast<size_t>(7), allocationSize(rec));
+    batch.records.push_back(rec);
+}
+
+// Parse the SAM lines read into the batch, on the filter threads
+inline void parseSamBatch(RecordBatch & batch, SamParser const & parser)
+{
+    std::string name;
+    char const * it = batch.lines.size == 0 ? NULL : &batch.lines.data[0];
+    char const * end = it + batch.lines.size;
+    while (it < end)
+    {
+        char const * eol = static_cast<char const *>(std::memchr(it, '\n', end - it));
+        char const * lineEnd = (eol > it && eol[-1] == '\r') ? eol - 1 : eol;
+        if (lineEnd != it && *it != '@')
+            parseSamLine(batch, parser, name, it, lineEnd);
+        it = eol + 1;
+    }
+}
+
+#endif /* SAMPARSE_H_ */
@@ -0,0 +1,233 @@
+#ifndef SEQCODEC_H_
+#define SEQCODEC_H_
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SEQCODEC_SSSE3 1
+#include <immintrin.h>
+#endif
+
+// Conversion of sequences and qualities between packed BAM and text.
+// Blocks of 16 packed bytes are converted with SSSE3 shuffles if the CPU supports them,
+// the remainder and other CPUs use the lookup tables.
+
+// Lookup tables of the scalar conversion
+struct BaseCodecTables
+{
+    char basePairs[512];            // both bases of a packed sequence byte
+    char reverseBasePairs[512];     // complemented bases of a packed sequence byte in reverse order
+    unsigned char code[256];        // 4-bit code of a base character, 15 (N) for unknown characters
+
+    BaseCodecTables()
+    {
+        char const * bases = "=ACMGRSVTWYHKDBN";
+        char const * complement = "=TGKCYSBAWRDMHVN";
+        for (unsigned i = 0; i < 256; ++i)
+        {
+            basePairs[2 * i] = bases[i >> 4];
+            basePairs[2 * i + 1] = bases[i & 0xf];
+            reverseBasePairs[2 * i] = complement[i & 0xf];
+            reverseBasePairs[2 * i + 1] = complement[i >> 4];
+        }
+        std::memset(code, 15, sizeof(code));
+        for (unsigned i = 0; i < 16; ++i)
+        {
+            code[static_cast<unsigned char>(bases[i])] = i;
+            code[static_cast<unsigned char>(std::tolower(bases[i]))] = i;
+        }
+    }
+};
+
+inline BaseCodecTables const & baseCodecTables()
+{
+    static BaseCodecTables const tables;
+    return tables;
+}
+
+#ifdef SEQCODEC_SSSE3
+
+inline bool hasSsse3()
+{
+    static bool const supported = __builtin_cpu_supports("ssse3");
+    return supported;
+}
+
+// The kernels convert whole blocks and return the number of bytes done, the caller converts the rest
+
+__attribute__((target("ssse3")))
+inline size_t _decodeBasesSsse3(char * out, unsigned char const * seq, size_t numBytes)
+{
+    __m128i const bases = _mm_setr_epi8('=', 'A', 'C', 'M', 'G', 'R', 'S', 'V', 'T', 'W', 'Y', 'H', 'K', 'D', 'B', 'N');
+    __m128i const mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= numBytes; i += 16, out += 32)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(seq + i));
+        __m128i hi = _mm_shuffle_epi8(bases, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(bases, _mm_and_si128(v, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    return i;
+}
+
+// Reverse complement, starting with the last numBytes bytes of seq
+__attribute__((target("ssse3")))
+inline size_t _decodeBasesReverseSsse3(char * out, unsigned char const * seq, size_t numBytes)
+{
+    __m128i const complement = _mm_setr_epi8('=', 'T', 'G', 'K', 'C', 'Y', 'S', 'B', 'A', 'W', 'R', 'D', 'M', 'H', 'V', 'N');
+    __m128i const reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    __m128i const mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= numBytes; i += 16, out += 32)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(seq + numBytes - i - 16));
+        v = _mm_shuffle_epi8(v, reverse);
+        __m128i hi = _mm_shuffle_epi8(complement, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(complement, _mm_and_si128(v, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+    return i;
+}
+
+// Encode 32 characters into 16 bytes per step.
+// Letters are case folded and looked up by their low nibble in the table of their high nibble.
+__attribute__((target("ssse3")))
+inline size_t _encodeBasesSsse3(unsigned char * out, char const * text, size_t numBytes)
+{
+    // Codes of the letters 0x40-0x4f and 0x50-0x5f
+    __m128i const letters4 = _mm_setr_epi8(15, 1, 14, 2, 13, 15, 15, 4, 11, 15, 15, 12, 15, 3, 15, 15);
+    __m128i const letters5 = _mm_setr_epi8(15, 15, 5, 6, 8, 15, 7, 9, 15, 10, 15, 15, 15, 15, 15, 15);
+    __m128i const mask = _mm_set1_epi8(0x0f);
+    __m128i const upper = _mm_set1_epi8(static_cast<char>(0xdf));
+    __m128i const unknown = _mm_set1_epi8(15);
+    __m128i const high4 = _mm_set1_epi8(4);
+    __m128i const high5 = _mm_set1_epi8(5);
+    __m128i const equals = _mm_set1_epi8('=');
+    __m128i const weights = _mm_set1_epi16(0x0110);     // 16 for the first, 1 for the second base of a byte
+
+    size_t i = 0;
+    for (; i + 16 <= numBytes; i += 16, out += 16)
+    {
+        __m128i packed[2];
+        for (unsigned j = 0; j < 2; ++j)
+        {
+            __m128i c = _mm_loadu_si128(reinterpret_cast<__m128i const *>(text + 2 * i + 16 * j));
+            __m128i u = _mm_and_si128(c, upper);
+            __m128i lo = _mm_and_si128(u, mask);
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(u, 4), mask);
+            __m128i in4 = _mm_cmpeq_epi8(hi, high4);
+            __m128i in5 = _mm_cmpeq_epi8(hi, high5);
+            __m128i codes = _mm_or_si128(_mm_and_si128(in4, _mm_shuffle_epi8(letters4, lo)),
+                                         _mm_and_si128(in5, _mm_shuffle_epi8(letters5, lo)));
+            codes = _mm_or_si128(codes, _mm_andnot_si128(_mm_or_si128(in4, in5), unknown));
+            codes = _mm_andnot_si128(_mm_cmpeq_epi8(c, equals), codes);
+            packed[j] = _mm_maddubs_epi16(codes, weights);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(packed[0], packed[1]));
+    }
+    return i;
+}
+
+// Add offset to every quality, reversing their order if requested
+__attribute__((target("ssse3")))
+inline size_t _offsetQualitiesSsse3(char * out, char const * qual, size_t len, char offset, bool reversed)
+{
+    __m128i const reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    __m128i const add = _mm_set1_epi8(offset);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v;
+        if (reversed)
+            v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(qual + len - i - 16)), reverse);
+        else
+            v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(qual + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_add_epi8(v, add));
+    }
+    return i;
+}
+
+#endif  // SEQCODEC_SSSE3
+
+// Write the len bases of a packed sequence as characters
+inline void decodeBases(char * out, char const * packed, int32_t len)
+{
+    unsigned char const * seq = reinterpret_cast<unsigned char const *>(packed);
+    size_t numBytes = len / 2;
+    size_t i = 0;
+#ifdef SEQCODEC_SSSE3
+    if (hasSsse3())
+        i = _decodeBasesSsse3(out, seq, numBytes);
+#endif
+    char const * basePairs = baseCodecTables().basePairs;
+    for (; i < numBytes; ++i)
+        std::memcpy(out + 2 * i, basePairs + 2 * seq[i], 2);
+    if (len & 1)
+        out[len - 1] = basePairs[2 * seq[numBytes]];
+}
+
+// Write the reverse complement of the len bases of a packed sequence as characters
+inline void decodeBasesReverse(char * out, char const * packed, int32_t len)
+{
+    unsigned char const * seq = reinterpret_cast<unsigned char const *>(packed);
+    size_t numBytes = len / 2;
+    char const * basePairs = baseCodecTables().reverseBasePairs;
+    if (len & 1)
+        *out++ = basePairs[2 * seq[numBytes] + 1];
+    size_t i = 0;
+#ifdef SEQCODEC_SSSE3
+    if (hasSsse3())
+        i = _decodeBasesReverseSsse3(out, seq, numBytes);
+#endif
+    for (; i < numBytes; ++i)
+        std::memcpy(out + 2 * i, basePairs + 2 * seq[numBytes - 1 - i], 2);
+}
+
+// Pack len base characters into (len + 1) / 2 bytes
+inline void encodeBases(char * out, char const * text, int32_t len)
+{
+    unsigned char * seq = reinterpret_cast<unsigned char *>(out);
+    unsigned char const * chars = reinterpret_cast<unsigned char const *>(text);
+    size_t numBytes = len / 2;
+    size_t i = 0;
+#ifdef SEQCODEC_SSSE3
+    if (hasSsse3())
+        i = _encodeBasesSsse3(seq, text, numBytes);
+#endif
+    unsigned char const * code = baseCodecTables().code;
+    for (; i < numBytes; ++i)
+        seq[i] = (code[chars[2 * i]] << 4) | code[chars[2 * i + 1]];
+    if (len & 1)
+        seq[numBytes] = code[chars[len - 1]] << 4;
+}
+
+// Add offset to len qualities, e.g. 33 to write phred+33 text or -33 to read it
+inline void offsetQualities(char * out, char const * qual, int32_t len, char offset)
+{
+    size_t i = 0;
+#ifdef SEQCODEC_SSSE3
+    if (hasSsse3())
+        i = _offsetQualitiesSsse3(out, qual, len, offset, false);
+#endif
+    for (; i < static_cast<size_t>(len); ++i)
+        out[i] = qual[i] + offset;
+}
+
+inline void offsetQualitiesReverse(char * out, char const * qual, int32_t len, char offset)
+{
+    size_t i = 0;
+#ifdef SEQCODEC_SSSE3
+    if (hasSsse3())
+        i = _offsetQualitiesSsse3(out, qual, len, offset, true);
+#endif
+    for (; i < static_cast<size_t>(len); ++i)
+        out[i] = qual[len - 1 - i] + offset;
+}
+
+#endif /* SEQCODEC_H_ */
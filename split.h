@@ -0,0 +1,209 @@
+#ifndef SPLIT_H_
+#define SPLIT_H_
+
+#include <seqan/bam_io.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <vector>
+#include "bgzf.h"
+#include "pipeline.h"
+
+using namespace seqan;
+
+// Virtual offset standing for the end of the file
+const uint64_t SPLIT_END = std::numeric_limits<uint64_t>::max();
+
+// Number of consecutive records that must pass the checks to accept a record start
+const unsigned SPLIT_CHECK_RECORDS = 4;
+
+// Uncompressed bytes searched for a record start before giving up
+const size_t SPLIT_MAX_SCAN = 64 * 1024 * 1024;
+
+// Part index of count parts of a BAM file, given as N/M with 0 <= N < M
+struct SplitSpec
+{
+    unsigned index;
+    unsigned count;
+
+    SplitSpec(): index(0), count(0) {}
+};
+
+inline bool parseSplitSpec(SplitSpec & spec, const CharString & str)
+{
+    spec = SplitSpec();
+    unsigned i = 0;
+    unsigned start = i;
+    for (; i < length(str) && std::isdigit(str[i]); ++i)
+        spec.index = spec.index * 10 + (str[i] - '0');
+    bool valid = i != start && i < length(str) && str[i] == '/';
+    start = ++i;
+    for (; i < length(str) && std::isdigit(str[i]); ++i)
+        spec.count = spec.count * 10 + (str[i] - '0');
+    valid = valid && i != start && i == length(str) && spec.index < spec.count;
+    if (!valid)
+        std::cerr << "ERROR: Invalid part \'" << str << "\' for --split, expected N/M with 0 <= N < M.\n";
+    return valid;
+}
+
+// Uncompressed data of the blocks from a block offset on, to search it for a record start
+struct SplitScanner
+{
+    std::FILE * file;
+    uint64_t nextBlock;
+    bool atEnd;
+    std::vector<char> block;
+    std::vector<char> data;
+    std::vector<uint64_t> blockOffsets;
+    std::vector<size_t> blockStarts;    // position of the data of each block in data
+
+    SplitScanner(std::FILE * file, uint64_t offset): file(file), nextBlock(offset), atEnd(false) {}
+};
+
+// Load blocks until there are size bytes of data, return false if the file ends before
+inline bool _load(SplitScanner & scanner, size_t size)
+{
+    while (scanner.data.size() < size && !scanner.atEnd)
+    {
+        size_t start = scanner.data.size();
+        if (!readBgzfBlock(scanner.block, scanner.file, scanner.nextBlock) ||
+            !inflateBgzfBlock(scanner.data, &scanner.block[0], scanner.block.size()) ||
+            scanner.data.size() == start)
+        {
+            scanner.atEnd = true;
+            break;
+        }
+        scanner.blockOffsets.push_back(scanner.nextBlock);
+        scanner.blockStarts.push_back(start);
+        scanner.nextBlock += scanner.block.size();
+    }
+    return scanner.data.size() >= size;
+}
+
+// Length of the record at data[pos] if its core and read name are plausible, 0 otherwise
+inline size_t _checkedRecordLength(SplitScanner & scanner, size_t pos, int32_t numRefs)
+{
+    BamAlignmentRecordCore c;
+    int32_t recordLen;
+    if (!_load(scanner, pos + RAW_SIZE_FIELD + sizeof(c)))
+        return 0;
+    std::memcpy(&recordLen, &scanner.data[pos], RAW_SIZE_FIELD);
+    std::memcpy(&c, &scanner.data[pos + RAW_SIZE_FIELD], sizeof(c));
+    if (recordLen < static_cast<int32_t>(sizeof(c)) ||
+        c.rID < -1 || c.rID >= numRefs || c.rNextId < -1 || c.rNextId >= numRefs ||
+        c.beginPos < -1 || c.pNext < -1 || c._l_qname < 2 || c._l_qseq < 0)
+        return 0;
+    uint64_t fixedLen = sizeof(c) + c._l_qname + 4 * static_cast<uint64_t>(c._n_cigar) +
+                        (static_cast<uint64_t>(c._l_qseq) + 1) / 2 + c._l_qseq;
+    if (fixedLen > static_cast<uint64_t>(recordLen))
+        return 0;
+
+    size_t name = pos + RAW_SIZE_FIELD + sizeof(c);
+    if (!_load(scanner, name + c._l_qname))
+        return 0;
+    for (unsigned i = 0; i + 1 < c._l_qname; ++i)
+        if (scanner.data[name + i] < '!' || scanner.data[name + i] > '~')
+            return 0;
+    if (scanner.data[name + c._l_qname - 1] != '\0')
+        return 0;
+    return RAW_SIZE_FIELD + recordLen;
+}
+
+// Check if a record starts at data[pos], by the checks on it and the records following it
+inline bool _isRecordStart(SplitScanner & scanner, size_t pos, int32_t numRefs)
+{
+    for (unsigned k = 0; k < SPLIT_CHECK_RECORDS; ++k)
+    {
+        if (k != 0 && !_load(scanner, pos + 1))
+            return pos == scanner.data.size();      // the records end with the file
+        size_t recordLen = _checkedRecordLength(scanner, pos, numRefs);
+        if (recordLen == 0)
+            return false;
+        pos += recordLen;
+    }
+    return true;
+}
+
+// Find the first BGZF block at or behind the compressed offset, confirmed by the header of the block behind it
+inline uint64_t _findBlock(std::FILE * file, uint64_t fileSize, uint64_t offset)
+{
+    std::vector<char> window(2 * BGZF_MAX_BLOCK_SIZE + BGZF_BLOCK_HEADER_LENGTH);
+    for (uint64_t start = offset; start < fileSize; start += BGZF_MAX_BLOCK_SIZE)
+    {
+        if (fseeko(file, start, SEEK_SET) != 0)
+            break;
+        size_t n = std::fread(&window[0], 1, window.size(), file);
+        for (size_t i = 0; i < std::min(n, static_cast<size_t>(BGZF_MAX_BLOCK_SIZE)); ++i)
+        {
+            size_t size = bgzfBlockSize(&window[i], n - i);
+            if (size == 0)
+                continue;
+            if (start + i + size == fileSize || (i + size < n && bgzfBlockSize(&window[i + size], n - i - size) != 0))
+                return start + i;
+        }
+    }
+    return fileSize;
+}
+
+// Virtual offset of the first record starting in or behind the first block at or behind the compressed offset.
+// All parts derive their boundaries from this, s.t. neighbouring parts agree on them.
+inline uint64_t _syncOffset(std::FILE * file, uint64_t fileSize, uint64_t offset, int32_t numRefs)
+{
+    SplitScanner scanner(file, _findBlock(file, fileSize, offset));
+    for (size_t pos = 0; pos < SPLIT_MAX_SCAN && _load(scanner, pos + 1); ++pos)
+    {
+        if (!_isRecordStart(scanner, pos, numRefs))
+            continue;
+        size_t b = std::upper_bound(scanner.blockStarts.begin(), scanner.blockStarts.end(), pos) -
+                   scanner.blockStarts.begin() - 1;
+        return (scanner.blockOffsets[b] << 16) | (pos - scanner.blockStarts[b]);
+    }
+    return SPLIT_END;
+}
+
+// Virtual offsets of the first record of the part and of the first record of the next part.
+// Part N starts with the first record behind the compressed offset N * fileSize / M, the records before
+// belong to part N - 1. headerEnd is the virtual offset of the first record of the file.
+inline bool findSplitRange(uint64_t & begin, uint64_t & end, const CharString & fileName, uint64_t headerEnd,
+                           const SplitSpec & spec, int32_t numRefs)
+{
+    std::FILE * file = std::fopen(toCString(fileName), "rb");
+    if (file == NULL)
+    {
+        std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+        return false;
+    }
+    fseeko(file, 0, SEEK_END);
+    uint64_t fileSize = ftello(file);
+
+    begin = headerEnd;
+    if (spec.index != 0)
+        begin = std::max(headerEnd, _syncOffset(file, fileSize, fileSize * spec.index / spec.count, numRefs));
+    end = SPLIT_END;
+    if (spec.index + 1 != spec.count)
+        end = std::max(headerEnd, _syncOffset(file, fileSize, fileSize * (spec.index + 1) / spec.count, numRefs));
+    std::fclose(file);
+
+    // Parts without records
+    if (begin >= end)
+        begin = end = headerEnd;
+    return true;
+}
+
+// Reads the records of one part of a BAM file in batches, up to the first record of the next part
+struct SplitReader
+{
+    BamFileIn & inFile;
+    uint64_t end;
+
+    bool operator()(RecordBatch & batch)
+    {
+        while (batch.arena.used < BATCH_SIZE && !atEnd(inFile) && static_cast<uint64_t>(position(inFile)) < end)
+            readRawRecord(batch, inFile);
+        return !batch.records.empty();
+    }
+};
+
+#endif /* SPLIT_H_ */
@@ -0,0 +1,58 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <iostream>
+
+struct Stats
+{
+    uint64_t filteredReads;
+    uint64_t passedReads;
+    uint64_t unsortedBarcodes;      // records out of order in an input sorted by barcode
+    uint64_t bloomLookups;          // barcodes checked against the Bloom filter
+    uint64_t bloomRejected;         // barcodes ruled out by the Bloom filter without a whitelist lookup
+    uint64_t unsortedRecords;       // records out of coordinate order in inputs merged by coordinate
+    uint64_t recordChecksum;        // sum of the hashes of the passed records, with --checksum
+    uint64_t duplicateRecords;      // passed records marked or removed as duplicates, with --dedup
+    uint64_t sampledRecords;        // passed records written with --reads_per_barcode
+    uint64_t singletonReads;        // FASTQ reads without a mate in the output, or unpaired with --fastq_r2
+
+    Stats(): filteredReads(0), passedReads(0), unsortedBarcodes(0), bloomLookups(0), bloomRejected(0),
+             unsortedRecords(0), recordChecksum(0), duplicateRecords(0), sampledRecords(0),
+             singletonReads(0) {}
+
+    inline void report()
+    {
+        std::cout << "\nSUMMARY" << std::endl;
+        std::cout << "Total records:\t\t" << (filteredReads + passedReads) << std::endl;
+        std::cout << "Filtered records:\t" << filteredReads << "\t(" << static_cast<double>(filteredReads)/(filteredReads + passedReads)*100 << "%)" 
+                    << "\nPassed records:\t\t" << passedReads << "\t(" << static_cast<double>(passedReads)/(filteredReads + passedReads)*100 << "%)" << std::endl;
+        if (bloomLookups != 0)
+            std::cout << "Bloom filter rejected:\t" << bloomRejected << " of " << bloomLookups << " barcodes\t("
+                      << static_cast<double>(bloomRejected)/bloomLookups*100 << "%)" << std::endl;
+        if (duplicateRecords != 0)
+            std::cout << "Duplicate records:\t" << duplicateRecords << "\t(" << static_cast<double>(duplicateRecords)/passedReads*100
+                      << "% of passed)" << std::endl;
+        if (sampledRecords != 0)
+            std::cout << "Sampled records:\t" << sampledRecords << "\t(" << static_cast<double>(sampledRecords)/passedReads*100
+                      << "% of passed)" << std::endl;
+        if (singletonReads != 0)
+            std::cout << "Singleton reads:\t" << singletonReads << std::endl;
+    }
+};  
+
+// Add the counts collected for one batch
+inline void merge(Stats & stats, Stats const & other)
+{
+    stats.filteredReads += other.filteredReads;
+    stats.passedReads += other.passedReads;
+    stats.unsortedBarcodes += other.unsortedBarcodes;
+    stats.bloomLookups += other.bloomLookups;
+    stats.bloomRejected += other.bloomRejected;
+    stats.unsortedRecords += other.unsortedRecords;
+    stats.recordChecksum += other.recordChecksum;
+    stats.duplicateRecords += other.duplicateRecords;
+    stats.sampledRecords += other.sampledRecords;
+    stats.singletonReads += other.singletonReads;
+}
+
+#endif /* STATS_H_ */
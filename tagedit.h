@@ -0,0 +1,171 @@
+#ifndef TAGEDIT_H_
+#define TAGEDIT_H_
+
+#include <seqan/bam_io.h>
+#include <bitset>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "bufferpool.h"
+#include "rawrecord.h"
+#include "samparse.h"
+
+using namespace seqan;
+
+// Edits of the tags of the kept records, applied to their raw tag blocks
+struct TagEdits
+{
+    bool keepListed;                    // keep only the listed tags, otherwise drop them
+    std::bitset<1 << 16> listed;        // tags given by --keep_tags or --drop_tags, by their 2-byte key
+    std::bitset<1 << 16> replaced;      // tags given by --add_tag, dropped from the records
+    std::vector<char> added;            // tags given by --add_tag, in BAM format
+    std::vector<std::string> labelTags; // tag with the whitelist label of each label ID, in BAM format
+
+    TagEdits(): keepListed(false) {}
+};
+
+inline bool empty(TagEdits const & edits)
+{
+    return !edits.keepListed && edits.listed.none() && edits.added.empty() && edits.labelTags.empty();
+}
+
+inline unsigned tagKey(char const * key)
+{
+    return static_cast<unsigned char>(key[0]) | (static_cast<unsigned char>(key[1]) << 8);
+}
+
+// Whether a tag stays in the records after the edits
+inline bool keepsTag(TagEdits const & edits, unsigned k)
+{
+    return edits.listed[k] == edits.keepListed && !edits.replaced[k];
+}
+
+// Parse a comma-separated list of tags like "CB,UB,RG"
+inline bool _parseTagList(std::bitset<1 << 16> & listed, CharString const & list, char const * option)
+{
+    char const * it = toCString(list);
+    char const * end = it + length(list);
+    while (it < end)
+    {
+        char const * comma = static_cast<char const *>(std::memchr(it, ',', end - it));
+        char const * tagEnd = (comma == NULL) ? end : comma;
+        if (tagEnd - it != 2)
+        {
+            std::cerr << "ERROR: Invalid tag list \'" << list << "\' for --" << option
+                      << ", expected tags separated by commas like CB,UB.\n";
+            return false;
+        }
+        listed.set(tagKey(it));
+        it = tagEnd + 1;
+    }
+    return true;
+}
+
+inline bool parseTagEdits(TagEdits & edits, CharString const & keepTags, CharString const & dropTags,
+                          String<CharString> const & addTags)
+{
+    if (!empty(keepTags) && !empty(dropTags))
+    {
+        std::cerr << "ERROR: Only one of --keep_tags and --drop_tags can be given.\n";
+        return false;
+    }
+    edits.keepListed = !empty(keepTags);
+    if (!_parseTagList(edits.listed, edits.keepListed ? keepTags : dropTags,
+                       edits.keepListed ? "keep_tags" : "drop_tags"))
+        return false;
+
+    for (unsigned i = 0; i < length(addTags); ++i)
+    {
+        char const * tag = toCString(addTags[i]);
+        size_t begin = edits.added.size();
+        edits.added.resize(begin + 2 * length(addTags[i]) + 16);
+        try
+        {
+            char * end = putSamTag(&edits.added[begin], tag, tag + length(addTags[i]));
+            edits.added.resize(end - &edits.added[0]);
+        }
+        catch (ParseError const &)
+        {
+            std::cerr << "ERROR: Invalid tag \'" << addTags[i] << "\' for --add_tag, expected KEY:TYPE:VALUE "
+                      << "like SM:Z:sample1.\n";
+            return false;
+        }
+        edits.replaced.set(tagKey(tag));
+    }
+    return true;
+}
+
+// Tag the records with the labels of the barcodes in the whitelist, as Z tags with the key labelTag
+inline bool setLabelTags(TagEdits & edits, CharString const & labelTag, std::vector<std::string> const & labels)
+{
+    if (length(labelTag) != 2)
+    {
+        std::cerr << "ERROR: Invalid tag '" << labelTag << "' for --label_tag, expected a key like SM.\n";
+        return false;
+    }
+    // Labels are looked up by their ID, 0 stands for barcodes without label
+    edits.labelTags.assign(1, std::string());
+    for (size_t i = 1; i < labels.size(); ++i)
+    {
+        std::string tag(toCString(labelTag), 2);
+        tag += 'Z';
+        tag += labels[i];
+        tag += '\0';
+        edits.labelTags.push_back(tag);
+    }
+    edits.replaced.set(tagKey(toCString(labelTag)));
+    return true;
+}
+
+// Apply the tag edits to a raw record, adding the tag of the whitelist label with the ID label if there are labels.
+// Without added tags, the kept tags are moved together in place.
+// Otherwise, the record is copied once into a new allocation of the arena, followed by the added tags.
+inline void editTags(RawRecord & rec, RecordArena & arena, TagEdits const & edits, uint16_t label)
+{
+    char const * it = tagsBegin(rec);
+    char const * end = tagsEnd(rec);
+    size_t fixedLength = it - rec.data;
+    char * data = rec.data;
+    std::string const * labelTag = edits.labelTags.empty() ? NULL : &edits.labelTags[label];
+    size_t addedLength = edits.added.size() + (labelTag == NULL ? 0 : labelTag->size());
+    if (addedLength != 0)
+    {
+        data = allocate(arena, (rec.length + addedLength + 7) & ~static_cast<size_t>(7));
+        std::memcpy(data, rec.data, fixedLength);
+    }
+
+    char * out = data + fixedLength;
+    char const * key;
+    char const * valBegin;
+    char const * valEnd;
+    char type;
+    char const * tag = it;
+    while (nextRawTag(it, end, key, type, valBegin, valEnd))
+    {
+        unsigned k = tagKey(key);
+        if (keepsTag(edits, k))
+        {
+            std::memmove(out, tag, it - tag);
+            out += it - tag;
+        }
+        tag = it;
+    }
+    if (!edits.added.empty())
+    {
+        std::memcpy(out, &edits.added[0], edits.added.size());
+        out += edits.added.size();
+    }
+    if (labelTag != NULL && !labelTag->empty())
+    {
+        std::memcpy(out, labelTag->data(), labelTag->size());
+        out += labelTag->size();
+    }
+
+    rec.data = data;
+    rec.length = out - data;
+    int32_t recordLen = rec.length - RAW_SIZE_FIELD;
+    std::memcpy(rec.data, &recordLen, RAW_SIZE_FIELD);
+}
+
+#endif /* TAGEDIT_H_ */
@@ -0,0 +1,964 @@
+#ifndef WHITELIST_H_
+#define WHITELIST_H_
+
+#include <seqan/sequence.h>
+#include <seqan/stream.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "barcode.h"
+
+using namespace seqan;
+
+// Separator of the components of a composite barcode in the whitelist file
+const char COMPONENT_SEPARATOR = '+';
+
+// Separator of the label column from the barcode in the whitelist file, besides spaces and tabs
+const char LABEL_SEPARATOR = ',';
+
+// Maximal number of distinct labels, their IDs are stored in 16 bits with 0 for no label
+const size_t MAX_LABELS = 0xffff;
+
+// Finalizer of splitmix64
+inline uint64_t mixHash(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Hash a barcode component, chaining from the hash of the previous components
+inline uint64_t hashBytes(char const * ptr, size_t len, uint64_t seed)
+{
+    uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+    for (; len >= 8; ptr += 8, len -= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, ptr, 8);
+        h = mixHash(h ^ word);
+    }
+    if (len != 0)
+    {
+        uint64_t word = 0;
+        std::memcpy(&word, ptr, len);
+        h = mixHash(h ^ word);
+    }
+    return h;
+}
+
+// Hash of all components of a barcode key
+inline uint64_t hashKey(BarcodeKey const & key)
+{
+    uint64_t h = 0;
+    for (unsigned c = 0; c < key.numComponents; ++c)
+        h = hashBytes(key.begin[c], key.end[c] - key.begin[c], h);
+    return h;
+}
+
+// Barcode key as stored in the whitelist, with the components separated by COMPONENT_SEPARATOR
+inline std::string keyString(BarcodeKey const & key)
+{
+    std::string barcode(key.begin[0], key.end[0]);
+    for (unsigned c = 1; c < key.numComponents; ++c)
+    {
+        barcode += COMPONENT_SEPARATOR;
+        barcode.append(key.begin[c], key.end[c]);
+    }
+    return barcode;
+}
+
+// Maximal number of barcode lists
+const unsigned MAX_BARCODE_LISTS = 32;
+
+// Entry of the whitelist hash table, refers to the barcode bytes in Whitelist::keys
+struct WhitelistSlot
+{
+    uint64_t hash;
+    uint32_t offset;
+    uint32_t lists;         // bit i is set if the barcode is in list i
+    uint16_t length;        // 0 for empty slots
+    uint16_t label;         // ID of the label of the barcode, 0 if it has none
+};
+
+// Bucket of the packed whitelist table with the barcodes in 2 bits per base.
+// All slots of a bucket are compared at once, a lookup continues to the next bucket only if it is full.
+const unsigned PACKED_BUCKET_SIZE = 4;
+
+struct PackedBucket
+{
+    uint64_t codes[PACKED_BUCKET_SIZE];     // PACKED_EMPTY for empty slots
+    uint32_t lists[PACKED_BUCKET_SIZE];
+    uint16_t labels[PACKED_BUCKET_SIZE];
+};
+
+const uint64_t PACKED_EMPTY = ~static_cast<uint64_t>(0);
+
+// Number of barcodes whose table entries are prefetched ahead while building the tables
+const size_t PREFETCH_DISTANCE = 16;
+
+// Blocked Bloom filter of the barcodes. A barcode sets one bit in each of the 8 words of a 64-byte block,
+// s.t. a test reads a single cache line and combines the words without branches.
+const unsigned BLOOM_BLOCK_WORDS = 8;
+const unsigned BLOOM_BITS_PER_BARCODE = 16;
+
+struct BloomFilter
+{
+    std::vector<uint64_t> words;    // blocks start at words[first], aligned to 64 bytes
+    size_t first;
+    unsigned shift;                 // the filter has 2^(64 - shift) blocks
+
+    BloomFilter(): first(0), shift(64) {}
+};
+
+inline bool empty(BloomFilter const & bloom)
+{
+    return bloom.words.empty();
+}
+
+// Open addressing hash table of the barcodes of all include and exclude lists.
+// Composite barcodes are stored as one key with the components separated by COMPONENT_SEPARATOR,
+// so a single probe resolves all tags of a record and all lists.
+// If all barcodes are ACGT strings of one of the lengths in packWhitelist(), they are also stored
+// packed, s.t. a lookup is a fixed-length packing and an integer comparison.
+// Barcodes with a label in the second column of the whitelist file carry its ID, the label of ID i is labels[i].
+struct Whitelist
+{
+    std::vector<WhitelistSlot> slots;
+    std::vector<char> keys;
+    std::vector<std::string> labels;
+    std::unordered_map<std::string, uint16_t> labelIds;
+    std::vector<PackedBucket> packed;
+    std::vector<uint32_t> sorted;   // slots in lexicographic order of their barcodes, see sortWhitelist()
+    BloomFilter bloom;
+    size_t size;
+    unsigned numComponents;
+    unsigned numLists;
+    unsigned packedLength;  // length of all barcodes if packed is used, 0 otherwise
+    unsigned packedShift;
+    uint32_t includeAny;    // a barcode must be in one of these lists, if any
+    uint32_t includeAll;    // a barcode must be in all of these lists
+    uint32_t exclude;       // a barcode must not be in any of these lists
+
+    Whitelist(): slots(16, WhitelistSlot()), labels(1), size(0), numComponents(1), numLists(0), packedLength(0), packedShift(64),
+                 includeAny(0), includeAll(0), exclude(0) {}
+};
+
+// Evaluate the set expression on the list memberships of a barcode
+inline bool passesLists(Whitelist const & wl, uint32_t lists)
+{
+    return (lists & wl.includeAll) == wl.includeAll &&
+           (wl.includeAny == 0 || (lists & wl.includeAny) != 0) &&
+           (lists & wl.exclude) == 0;
+}
+
+// Compare the key of a slot with the components of a barcode key
+inline bool equalsKey(Whitelist const & wl, WhitelistSlot const & slot, BarcodeKey const & key)
+{
+    char const * it = &wl.keys[slot.offset];
+    char const * end = it + slot.length;
+    for (unsigned c = 0; c < key.numComponents; ++c)
+    {
+        size_t len = key.end[c] - key.begin[c];
+        if (c != 0)
+        {
+            if (it == end || *it != COMPONENT_SEPARATOR)
+                return false;
+            ++it;
+        }
+        if (static_cast<size_t>(end - it) < len || std::memcmp(it, key.begin[c], len) != 0)
+            return false;
+        it += len;
+    }
+    return it == end;
+}
+
+// Return the slot of a barcode key, or -1 if it is not whitelisted
+inline int64_t findBarcode(Whitelist const & wl, BarcodeKey const & key, uint64_t hash)
+{
+    size_t mask = wl.slots.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask)
+    {
+        WhitelistSlot const & slot = wl.slots[i];
+        if (slot.length == 0)
+            return -1;
+        if (slot.hash == hash && equalsKey(wl, slot, key))
+            return i;
+    }
+}
+
+// Pack LENGTH bases into 2 bits each, return false if there are other characters than ACGT.
+// Eight bases are packed at a time from the bits 1 and 2 of their characters (A 00, C 01, G 11, T 10).
+// The characters are rebuilt from the codes to validate them.
+template <unsigned LENGTH>
+inline bool packBarcode(uint64_t & code, char const * barcode)
+{
+    static_assert(LENGTH < 32, "Packed barcodes must fit into 62 bits.");
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t packed = 0;
+    bool valid = true;
+    for (unsigned i = 0; i < LENGTH; i += 8)
+    {
+        uint64_t word = 0x41 * ones;        // missing bases of the last word are A
+        std::memcpy(&word, barcode + i, std::min(8u, LENGTH - i));
+        uint64_t bases = (word >> 1) & (3 * ones);
+        uint64_t isT = (bases >> 1) & ~bases & ones;
+        valid &= ((((bases << 1) | (0x41 * ones)) ^ (0x11 * isT)) == word);
+        bases = (bases | (bases >> 6)) & 0x000f000f000f000fULL;
+        bases = (bases | (bases >> 12)) & 0x000000ff000000ffULL;
+        bases = (bases | (bases >> 24)) & 0xffffULL;
+        packed = (packed << 16) | bases;
+    }
+    code = packed;
+    return valid;
+}
+
+// Bucket of a packed barcode by multiplicative hashing, the table has 2^(64 - shift) buckets
+inline size_t _packedBucket(uint64_t code, unsigned shift)
+{
+    return (code * 0x9e3779b97f4a7c15ULL) >> shift;
+}
+
+template <unsigned LENGTH>
+inline uint32_t _packedLists(Whitelist const & wl, char const * barcode, uint16_t & label)
+{
+    uint64_t code;
+    if (!packBarcode<LENGTH>(code, barcode))
+        return 0;
+    size_t mask = wl.packed.size() - 1;
+    for (size_t i = _packedBucket(code, wl.packedShift); ; i = (i + 1) & mask)
+    {
+        PackedBucket const & bucket = wl.packed[i];
+        uint32_t lists = 0;
+        bool full = true;
+        for (unsigned j = 0; j < PACKED_BUCKET_SIZE; ++j)
+        {
+            lists |= (bucket.codes[j] == code) ? bucket.lists[j] : 0;
+            label |= (bucket.codes[j] == code) ? bucket.labels[j] : 0;
+            full &= bucket.codes[j] != PACKED_EMPTY;
+        }
+        if (lists != 0 || !full)
+            return lists;
+    }
+}
+
+// Lists containing a barcode of the packed table and its label, dispatched on the barcode length of the whitelist
+inline uint32_t packedLists(Whitelist const & wl, char const * barcode, size_t length, uint16_t & label)
+{
+    label = 0;
+    if (length != wl.packedLength)
+        return 0;
+    switch (wl.packedLength)
+    {
+        case 12: return _packedLists<12>(wl, barcode, label);
+        case 16: return _packedLists<16>(wl, barcode, label);
+        case 20: return _packedLists<20>(wl, barcode, label);
+        case 24: return _packedLists<24>(wl, barcode, label);
+        case 30: return _packedLists<30>(wl, barcode, label);
+        default: return 0;
+    }
+}
+
+inline void _placePacked(Whitelist & wl, uint64_t code, WhitelistSlot const & slot)
+{
+    size_t mask = wl.packed.size() - 1;
+    size_t i = _packedBucket(code, wl.packedShift);
+    unsigned j = 0;
+    while (true)
+    {
+        while (j < PACKED_BUCKET_SIZE && wl.packed[i].codes[j] != PACKED_EMPTY)
+            ++j;
+        if (j < PACKED_BUCKET_SIZE)
+            break;
+        i = (i + 1) & mask;
+        j = 0;
+    }
+    wl.packed[i].codes[j] = code;
+    wl.packed[i].lists[j] = slot.lists;
+    wl.packed[i].labels[j] = slot.label;
+}
+
+// Fill the packed table, return false if a barcode is not an ACGT string of LENGTH bases
+template <unsigned LENGTH>
+inline bool _fillPacked(Whitelist & wl)
+{
+    // At most one barcode per bucket on average, few buckets overflow
+    size_t numBuckets = 2;
+    while (numBuckets < wl.size)
+        numBuckets *= 2;
+    PackedBucket empty;
+    std::fill(empty.codes, empty.codes + PACKED_BUCKET_SIZE, PACKED_EMPTY);
+    std::fill(empty.lists, empty.lists + PACKED_BUCKET_SIZE, 0);
+    std::fill(empty.labels, empty.labels + PACKED_BUCKET_SIZE, 0);
+    wl.packed.assign(numBuckets, empty);
+    wl.packedShift = 64 - __builtin_ctzll(numBuckets);
+
+    // The keys of the slots ahead are prefetched, and a barcode is placed PREFETCH_DISTANCE barcodes
+    // after its bucket was prefetched
+    uint64_t codes[PREFETCH_DISTANCE];
+    size_t slots[PREFETCH_DISTANCE];
+    size_t numPacked = 0;
+    for (size_t s = 0; s < wl.slots.size(); ++s)
+    {
+        if (s + 2 * PREFETCH_DISTANCE < wl.slots.size())
+            __builtin_prefetch(&wl.keys[wl.slots[s + 2 * PREFETCH_DISTANCE].offset]);
+        WhitelistSlot const & slot = wl.slots[s];
+        if (slot.length == 0)
+            continue;
+        size_t k = numPacked++ % PREFETCH_DISTANCE;
+        if (numPacked > PREFETCH_DISTANCE)
+            _placePacked(wl, codes[k], wl.slots[slots[k]]);
+        if (slot.length != LENGTH || !packBarcode<LENGTH>(codes[k], &wl.keys[slot.offset]))
+            return false;
+        slots[k] = s;
+        __builtin_prefetch(&wl.packed[_packedBucket(codes[k], wl.packedShift)], 1);
+    }
+    for (size_t n = std::min(numPacked, PREFETCH_DISTANCE); n > 0; --n)
+    {
+        size_t k = (numPacked - n) % PREFETCH_DISTANCE;
+        _placePacked(wl, codes[k], wl.slots[slots[k]]);
+    }
+    return true;
+}
+
+// Build the packed table if all barcodes are single ACGT strings of a common length with a packed kernel
+inline void packWhitelist(Whitelist & wl)
+{
+    wl.packed.clear();
+    wl.packedLength = 0;
+    if (wl.numComponents != 1 || wl.size == 0)
+        return;
+
+    unsigned length = 0;
+    for (size_t s = 0; length == 0; ++s)
+        length = wl.slots[s].length;
+
+    bool packed = false;
+    switch (length)
+    {
+        case 12: packed = _fillPacked<12>(wl); break;
+        case 16: packed = _fillPacked<16>(wl); break;
+        case 20: packed = _fillPacked<20>(wl); break;
+        case 24: packed = _fillPacked<24>(wl); break;
+        case 30: packed = _fillPacked<30>(wl); break;
+    }
+    if (packed)
+        wl.packedLength = length;
+    else
+        std::vector<PackedBucket>().swap(wl.packed);
+}
+
+// The block is selected by the high bits of the hash, the bits within the words by 6 bits each of the low 48 bits
+inline uint64_t const * _bloomBlock(BloomFilter const & bloom, uint64_t hash)
+{
+    return &bloom.words[bloom.first + BLOOM_BLOCK_WORDS * (bloom.shift < 64 ? hash >> bloom.shift : 0)];
+}
+
+inline void _bloomInsert(BloomFilter & bloom, uint64_t hash)
+{
+    uint64_t * block = const_cast<uint64_t *>(_bloomBlock(bloom, hash));
+    for (unsigned i = 0; i < BLOOM_BLOCK_WORDS; ++i)
+        block[i] |= static_cast<uint64_t>(1) << ((hash >> (6 * i)) & 63);
+}
+
+inline bool _bloomContains(BloomFilter const & bloom, uint64_t hash)
+{
+    uint64_t const * block = _bloomBlock(bloom, hash);
+    uint64_t all = 1;
+    for (unsigned i = 0; i < BLOOM_BLOCK_WORDS; ++i)
+        all &= block[i] >> ((hash >> (6 * i)) & 63);
+    return all != 0;
+}
+
+// Hash of a barcode for the Bloom filter, of the packed barcode if the whitelist is packed.
+// Return false if the barcode cannot be in the whitelist at all.
+inline bool _bloomHash(uint64_t & hash, Whitelist const & wl, BarcodeKey const & key)
+{
+    if (wl.packedLength == 0)
+    {
+        hash = hashKey(key);
+        return true;
+    }
+    uint64_t code;
+    bool valid = false;
+    if (static_cast<size_t>(key.end[0] - key.begin[0]) == wl.packedLength)
+    {
+        switch (wl.packedLength)
+        {
+            case 12: valid = packBarcode<12>(code, key.begin[0]); break;
+            case 16: valid = packBarcode<16>(code, key.begin[0]); break;
+            case 20: valid = packBarcode<20>(code, key.begin[0]); break;
+            case 24: valid = packBarcode<24>(code, key.begin[0]); break;
+            case 30: valid = packBarcode<30>(code, key.begin[0]); break;
+        }
+    }
+    hash = valid ? mixHash(code) : 0;
+    return valid;
+}
+
+// Build the Bloom filter of all barcodes, sized by their number
+inline void buildBloomFilter(Whitelist & wl)
+{
+    size_t numBlocks = 1;
+    while (numBlocks * BLOOM_BLOCK_WORDS * 64 < wl.size * BLOOM_BITS_PER_BARCODE)
+        numBlocks *= 2;
+    BloomFilter & bloom = wl.bloom;
+    bloom.words.assign((numBlocks + 1) * BLOOM_BLOCK_WORDS, 0);
+    bloom.first = (-reinterpret_cast<uintptr_t>(bloom.words.data()) % 64) / sizeof(uint64_t);
+    bloom.shift = 64 - __builtin_ctzll(numBlocks);
+
+    for (WhitelistSlot const & slot : wl.slots)
+    {
+        if (slot.length == 0)
+            continue;
+        uint64_t hash = slot.hash;
+        if (wl.packedLength != 0)
+        {
+            BarcodeKey key;
+            key.numComponents = 1;
+            key.begin[0] = &wl.keys[slot.offset];
+            key.end[0] = key.begin[0] + slot.length;
+            _bloomHash(hash, wl, key);
+        }
+        _bloomInsert(bloom, hash);
+    }
+    std::cout << "[bcsubset] Built a Bloom filter of " << ((numBlocks * BLOOM_BLOCK_WORDS * 8 + 1023) >> 10)
+              << " KB for the barcodes." << std::endl;
+}
+
+// Check if a barcode key may be in the whitelist, false if the Bloom filter rules it out
+inline bool mayContainBarcode(Whitelist const & wl, BarcodeKey const & key)
+{
+    uint64_t hash;
+    return _bloomHash(hash, wl, key) && _bloomContains(wl.bloom, hash);
+}
+
+// Lists containing a barcode key, 0 if it is in none, and the ID of its label
+inline uint32_t barcodeLists(Whitelist const & wl, BarcodeKey const & key, uint16_t & label)
+{
+    if (wl.packedLength != 0)
+        return packedLists(wl, key.begin[0], key.end[0] - key.begin[0], label);
+    int64_t slot = findBarcode(wl, key, hashKey(key));
+    label = (slot < 0) ? 0 : wl.slots[slot].label;
+    return (slot < 0) ? 0 : wl.slots[slot].lists;
+}
+
+inline bool isWhitelisted(Whitelist const & wl, BarcodeKey const & key)
+{
+    uint16_t label;
+    return passesLists(wl, barcodeLists(wl, key, label));
+}
+
+// Compare two byte strings lexicographically, a proper prefix is smaller
+inline int compareBytes(char const * a, size_t lenA, char const * b, size_t lenB)
+{
+    int cmp = std::memcmp(a, b, std::min(lenA, lenB));
+    if (cmp != 0)
+        return cmp;
+    return (lenA < lenB) ? -1 : (lenA > lenB);
+}
+
+inline int _compareSorted(Whitelist const & wl, size_t i, char const * barcode, size_t length)
+{
+    WhitelistSlot const & slot = wl.slots[wl.sorted[i]];
+    return compareBytes(&wl.keys[slot.offset], slot.length, barcode, length);
+}
+
+// Sort the barcodes for lookups in inputs sorted by barcode
+inline void sortWhitelist(Whitelist & wl)
+{
+    wl.sorted.clear();
+    for (size_t i = 0; i < wl.slots.size(); ++i)
+        if (wl.slots[i].length != 0)
+            wl.sorted.push_back(i);
+    std::sort(wl.sorted.begin(), wl.sorted.end(), [&wl](uint32_t a, uint32_t b)
+    {
+        WhitelistSlot const & x = wl.slots[a];
+        WhitelistSlot const & y = wl.slots[b];
+        return compareBytes(&wl.keys[x.offset], x.length, &wl.keys[y.offset], y.length) < 0;
+    });
+}
+
+// Position in the sorted whitelist for the records of one batch of an input sorted by barcode.
+// The barcodes are looked up by advancing through the sorted whitelist, the records of a run
+// with the same barcode take a single comparison. The barcode of the run is copied, since the
+// records may be edited after their lookup.
+struct SortedCursor
+{
+    size_t pos;             // first sorted barcode not less than the current run
+    bool started;           // false before the first record
+    std::string run;        // barcode of the current run
+    uint32_t lists;         // lists of the current run
+    uint16_t label;         // label of the current run
+    uint64_t unsorted;      // records with a barcode before the previous one
+
+    SortedCursor(): pos(0), started(false), lists(0), label(0), unsorted(0) {}
+};
+
+// Lists containing a barcode and its label, advancing the cursor to it.
+// A barcode before the current run is counted as unsorted and searched from the start.
+inline uint32_t sortedBarcodeLists(Whitelist const & wl, SortedCursor & cursor, char const * barcode, size_t length,
+                                   uint16_t & label)
+{
+    if (cursor.started)
+    {
+        int cmp = compareBytes(barcode, length, cursor.run.data(), cursor.run.size());
+        if (cmp == 0)
+        {
+            label = cursor.label;
+            return cursor.lists;
+        }
+        if (cmp < 0)
+        {
+            ++cursor.unsorted;
+            cursor.pos = 0;
+        }
+    }
+
+    // Gallop forward from the current position, then search the last step
+    size_t n = wl.sorted.size();
+    size_t lo = cursor.pos;
+    size_t hi = lo;
+    for (size_t step = 1; hi < n && _compareSorted(wl, hi, barcode, length) < 0; step *= 2)
+    {
+        lo = hi + 1;
+        hi += step;
+    }
+    hi = std::min(hi, n);
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (_compareSorted(wl, mid, barcode, length) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    cursor.pos = lo;
+    cursor.started = true;
+    cursor.run.assign(barcode, length);
+    bool found = lo < n && _compareSorted(wl, lo, barcode, length) == 0;
+    cursor.lists = found ? wl.slots[wl.sorted[lo]].lists : 0;
+    cursor.label = found ? wl.slots[wl.sorted[lo]].label : 0;
+    label = cursor.label;
+    return cursor.lists;
+}
+
+// Output group of a barcode: the first include list containing it, 0 if there is none
+inline uint16_t barcodeGroup(Whitelist const & wl, uint32_t lists)
+{
+    uint32_t include = lists & (wl.includeAny | wl.includeAll);
+    return (include == 0) ? 0 : __builtin_ctz(include);
+}
+
+// Split a whitelist entry into its components
+// Return false if the number of components does not match
+inline bool splitEntry(BarcodeKey & key, char const * entry, size_t length, unsigned numComponents)
+{
+    char const * it = entry;
+    char const * end = entry + length;
+    key.numComponents = 0;
+    while (key.numComponents < numComponents)
+    {
+        char const * sep = static_cast<char const *>(std::memchr(it, COMPONENT_SEPARATOR, end - it));
+        key.begin[key.numComponents] = it;
+        key.end[key.numComponents] = (sep == NULL) ? end : sep;
+        ++key.numComponents;
+        if (sep == NULL)
+            break;
+        it = sep + 1;
+    }
+    return key.numComponents == numComponents && key.end[numComponents - 1] == end;
+}
+
+// Rehash the table into at least numSlots slots
+inline void _reserveSlots(Whitelist & wl, size_t numSlots)
+{
+    size_t size = wl.slots.size();
+    while (size < numSlots)
+        size *= 2;
+    if (size == wl.slots.size())
+        return;
+    std::vector<WhitelistSlot> slots(size, WhitelistSlot());
+    size_t mask = size - 1;
+    for (WhitelistSlot const & slot : wl.slots)
+    {
+        if (slot.length == 0)
+            continue;
+        size_t i = slot.hash & mask;
+        while (slots[i].length != 0)
+            i = (i + 1) & mask;
+        slots[i] = slot;
+    }
+    wl.slots.swap(slots);
+}
+
+// Slot of a whitelist entry, or the empty slot to insert it into
+inline size_t _entrySlot(Whitelist const & wl, char const * entry, size_t length, uint64_t hash)
+{
+    size_t mask = wl.slots.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask)
+    {
+        WhitelistSlot const & slot = wl.slots[i];
+        if (slot.length == 0 ||
+            (slot.hash == hash && slot.length == length && std::memcmp(&wl.keys[slot.offset], entry, length) == 0))
+            return i;
+    }
+}
+
+// Barcode of a whitelist file and its label, located in the file text
+struct WhitelistEntry
+{
+    uint64_t hash;
+    size_t begin;
+    uint16_t length;
+    uint16_t labelOffset;   // position of the label behind begin
+    uint16_t labelLength;   // 0 without label
+    uint16_t label;         // ID of the label, assigned after parsing
+};
+
+// Barcodes of a chunk of whole lines of a whitelist file
+struct WhitelistChunk
+{
+    size_t begin;
+    size_t end;
+    std::vector<WhitelistEntry> entries;
+    size_t count;
+    bool malformed;         // the last entry does not have the components of the whitelist
+};
+
+// Part of the hash table that one thread inserts into.
+// The keys of the new slots are collected in keys and moved to the whitelist afterwards,
+// entries whose probe runs past the end of the shard are left in overflow for a sequential pass.
+struct WhitelistShard
+{
+    size_t begin;
+    size_t end;
+    std::vector<char> keys;
+    std::vector<size_t> created;
+    std::vector<char> isCreated;
+    std::vector<WhitelistEntry> overflow;
+    size_t keysOffset;
+};
+
+// Run fn(i) for all i < n, on n threads if n > 1
+template <typename TFunction>
+inline void _runParallel(unsigned n, TFunction const & fn)
+{
+    if (n == 1)
+    {
+        fn(0u);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < n; ++i)
+        threads.emplace_back(fn, i);
+    for (std::thread & thread : threads)
+        thread.join();
+}
+
+inline bool _isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline bool _isColumnEnd(char c)
+{
+    return _isSpace(c) || c == LABEL_SEPARATOR;
+}
+
+// Split a chunk into lines of a barcode and an optional label and hash the barcodes,
+// stop at the first malformed barcode. Further columns are ignored.
+inline void _parseChunk(WhitelistChunk & chunk, std::string const & text, unsigned numComponents)
+{
+    char const * data = text.data();
+    size_t i = chunk.begin;
+    chunk.count = 0;
+    chunk.malformed = false;
+    while (true)
+    {
+        while (i < chunk.end && _isSpace(data[i]))
+            ++i;
+        if (i == chunk.end)
+            return;
+        size_t begin = i;
+        while (i < chunk.end && !_isColumnEnd(data[i]))
+            ++i;
+        size_t end = i;
+        while (i < chunk.end && (data[i] == ' ' || data[i] == '\t' || data[i] == LABEL_SEPARATOR))
+            ++i;
+        size_t labelBegin = i;
+        while (i < chunk.end && !_isColumnEnd(data[i]))
+            ++i;
+        size_t labelEnd = i;
+        char const * lineEnd = static_cast<char const *>(std::memchr(data + i, '\n', chunk.end - i));
+        i = (lineEnd == NULL) ? chunk.end : lineEnd - data;
+
+        ++chunk.count;
+        BarcodeKey key;
+        WhitelistEntry entry = {0, begin, static_cast<uint16_t>(end - begin), static_cast<uint16_t>(labelBegin - begin),
+                                static_cast<uint16_t>(labelEnd - labelBegin), 0};
+        chunk.malformed = end - begin > 0xffff || labelEnd - begin > 0xffff ||
+                          !splitEntry(key, data + begin, end - begin, numComponents);
+        if (!chunk.malformed)
+            entry.hash = hashKey(key);
+        chunk.entries.push_back(entry);
+        if (chunk.malformed)
+            return;
+    }
+}
+
+// Insert the entries of all chunks that start probing in the shard, in file order
+inline void _insertShard(WhitelistShard & shard, Whitelist & wl, std::vector<WhitelistChunk> const & chunks,
+                         std::string const & text, uint32_t list)
+{
+    size_t mask = wl.slots.size() - 1;
+    shard.isCreated.assign(shard.end - shard.begin, 0);
+    for (WhitelistChunk const & chunk : chunks)
+    {
+        std::vector<WhitelistEntry> const & entries = chunk.entries;
+        for (size_t k = 0; k < entries.size(); ++k)
+        {
+            // The slots are accessed at random, fetch them ahead
+            if (k + PREFETCH_DISTANCE < entries.size())
+            {
+                size_t ahead = entries[k + PREFETCH_DISTANCE].hash & mask;
+                if (ahead >= shard.begin && ahead < shard.end)
+                {
+                    __builtin_prefetch(&wl.slots[ahead], 1);
+                    __builtin_prefetch(&shard.isCreated[ahead - shard.begin], 1);
+                }
+            }
+            WhitelistEntry const & entry = entries[k];
+            size_t i = entry.hash & mask;
+            if (i < shard.begin || i >= shard.end)
+                continue;
+            char const * key = text.data() + entry.begin;
+            for (; i < shard.end; ++i)
+            {
+                WhitelistSlot & slot = wl.slots[i];
+                if (slot.length == 0)
+                {
+                    slot.hash = entry.hash;
+                    slot.offset = shard.keys.size();
+                    slot.lists = list;
+                    slot.length = entry.length;
+                    slot.label = entry.label;
+                    shard.keys.insert(shard.keys.end(), key, key + entry.length);
+                    shard.created.push_back(i);
+                    shard.isCreated[i - shard.begin] = 1;
+                    break;
+                }
+                char const * slotKey = shard.isCreated[i - shard.begin] ? &shard.keys[slot.offset] : &wl.keys[slot.offset];
+                if (slot.hash == entry.hash && slot.length == entry.length &&
+                    std::memcmp(slotKey, key, entry.length) == 0)
+                {
+                    slot.lists |= list;
+                    if (slot.label == 0)
+                        slot.label = entry.label;
+                    break;
+                }
+            }
+            if (i == shard.end)
+                shard.overflow.push_back(entry);
+        }
+    }
+}
+
+// Assign IDs to the labels of the entries, shared by all lists. Neighbouring lines often share a label.
+inline bool _assignLabels(Whitelist & wl, std::vector<WhitelistChunk> & chunks, std::string const & text,
+                          CharString const & fileName)
+{
+    std::string label;
+    uint16_t id = 0;
+    for (WhitelistChunk & chunk : chunks)
+    {
+        for (WhitelistEntry & entry : chunk.entries)
+        {
+            if (entry.labelLength == 0)
+                continue;
+            char const * name = text.data() + entry.begin + entry.labelOffset;
+            if (id == 0 || label.compare(0, std::string::npos, name, entry.labelLength) != 0)
+            {
+                label.assign(name, entry.labelLength);
+                std::unordered_map<std::string, uint16_t>::iterator it = wl.labelIds.find(label);
+                if (it == wl.labelIds.end())
+                {
+                    if (wl.labels.size() > MAX_LABELS)
+                    {
+                        std::cerr << "ERROR: More than " << MAX_LABELS << " different labels in \'" << fileName
+                                  << "\'.\n";
+                        return false;
+                    }
+                    it = wl.labelIds.insert(std::make_pair(label, static_cast<uint16_t>(wl.labels.size()))).first;
+                    wl.labels.push_back(label);
+                }
+                id = it->second;
+            }
+            entry.label = id;
+        }
+    }
+    return true;
+}
+
+// Read a whole barcode list file, gzip and bzip2 compressed files are decompressed
+inline bool readWhitelistText(std::string & text, CharString const & fileName)
+{
+    VirtualStream<char, Input> in;
+    if (!open(in, toCString(fileName)))
+    {
+        std::cerr << "ERROR: Could not open " << fileName << " for reading.\n";
+        return false;
+    }
+    // The conversion of VirtualStream to bool only tells if it is open
+    const size_t blockSize = 1 << 20;
+    while (in.good())
+    {
+        size_t size = text.size();
+        text.resize(size + blockSize);
+        in.read(&text[size], blockSize);
+        text.resize(size + in.gcount());
+    }
+    if (in.bad())
+    {
+        std::cerr << "ERROR: Could not read " << fileName << ".\n";
+        return false;
+    }
+    return true;
+}
+
+//Read a text file containing a list of barcodes, put into the whitelist hash table as list listIdx
+//Composite barcodes list their components separated by '+'
+//A second column separated by spaces, a tab or a comma labels the barcode, e.g. with its sample
+//The file is split into chunks of lines that are parsed and hashed on numThreads threads,
+//then each thread inserts the barcodes of one range of the hash table
+//Return false if text file can not be opened
+//Return true if success
+bool readWhitelist(Whitelist & wlBarcodes, const CharString & bcWlFileName, const unsigned listIdx,
+                   const unsigned numThreads)
+{
+    std::string text;
+    if (!readWhitelistText(text, bcWlFileName))
+        return false;
+
+    // Chunks end at line ends
+    std::vector<WhitelistChunk> chunks(std::max(1u, numThreads));
+    size_t pos = 0;
+    for (unsigned c = 0; c < chunks.size(); ++c)
+    {
+        chunks[c].begin = pos;
+        pos = std::max(pos, text.size() * (c + 1) / chunks.size());
+        char const * lineEnd = static_cast<char const *>(std::memchr(text.data() + pos, '\n', text.size() - pos));
+        pos = (lineEnd == NULL || c + 1 == chunks.size()) ? text.size() : lineEnd - text.data() + 1;
+        chunks[c].end = pos;
+    }
+    _runParallel(chunks.size(), [&](unsigned c) { _parseChunk(chunks[c], text, wlBarcodes.numComponents); });
+
+    size_t count = 0;
+    for (WhitelistChunk const & chunk : chunks)
+    {
+        count += chunk.count;
+        if (chunk.malformed)
+        {
+            WhitelistEntry const & entry = chunk.entries.back();
+            std::cerr << "ERROR: Barcode \'" << text.substr(entry.begin, entry.length) << "\' in \'" << bcWlFileName
+                      << "\' does not have " << wlBarcodes.numComponents << " component(s).\n";
+            return false;
+        }
+    }
+    if (!_assignLabels(wlBarcodes, chunks, text, bcWlFileName))
+        return false;
+
+    // Keep the load factor below 1/2 even if all barcodes are new
+    _reserveSlots(wlBarcodes, 2 * (wlBarcodes.size + count));
+    size_t numSlots = wlBarcodes.slots.size();
+    std::vector<WhitelistShard> shards(std::min<size_t>(chunks.size(), numSlots));
+    for (size_t s = 0; s < shards.size(); ++s)
+    {
+        shards[s].begin = numSlots * s / shards.size();
+        shards[s].end = numSlots * (s + 1) / shards.size();
+    }
+    uint32_t list = 1u << listIdx;
+    _runParallel(shards.size(), [&](unsigned s) { _insertShard(shards[s], wlBarcodes, chunks, text, list); });
+
+    // Move the new keys behind the existing ones
+    size_t keysSize = wlBarcodes.keys.size();
+    for (WhitelistShard & shard : shards)
+    {
+        shard.keysOffset = keysSize;
+        keysSize += shard.keys.size();
+        wlBarcodes.size += shard.created.size();
+    }
+    wlBarcodes.keys.resize(keysSize);
+    _runParallel(shards.size(), [&](unsigned s)
+    {
+        WhitelistShard & shard = shards[s];
+        if (!shard.keys.empty())
+            std::memcpy(&wlBarcodes.keys[shard.keysOffset], shard.keys.data(), shard.keys.size());
+        for (size_t i : shard.created)
+            wlBarcodes.slots[i].offset += shard.keysOffset;
+    });
+
+    for (WhitelistShard const & shard : shards)
+    {
+        for (WhitelistEntry const & entry : shard.overflow)
+        {
+            char const * key = text.data() + entry.begin;
+            WhitelistSlot & slot = wlBarcodes.slots[_entrySlot(wlBarcodes, key, entry.length, entry.hash)];
+            if (slot.length == 0)
+            {
+                slot.hash = entry.hash;
+                slot.offset = wlBarcodes.keys.size();
+                slot.lists = 0;
+                slot.length = entry.length;
+                slot.label = 0;
+                wlBarcodes.keys.insert(wlBarcodes.keys.end(), key, key + entry.length);
+                ++wlBarcodes.size;
+            }
+            slot.lists |= list;
+            if (slot.label == 0)
+                slot.label = entry.label;
+        }
+    }
+
+    std::cout << "\n[bcsubset] Loaded " << count << " barcodes from \'" << bcWlFileName << "\'." << std::endl;
+    if (count == 0)
+        std::cerr << "WARNING: No barcodes in \'" << bcWlFileName << "\'.\n";
+
+    return true;
+}
+
+// Read all include and exclude lists into one whitelist
+// With requireAll, a barcode must be in all include lists instead of one of them
+bool readWhitelists(Whitelist & wlBarcodes, const String<CharString> & includeFileNames,
+                    const String<CharString> & excludeFileNames, const bool requireAll, const unsigned numThreads)
+{
+    if (length(includeFileNames) + length(excludeFileNames) > MAX_BARCODE_LISTS)
+    {
+        std::cerr << "ERROR: At most " << MAX_BARCODE_LISTS << " barcode lists are supported.\n";
+        return false;
+    }
+
+    for (unsigned i = 0; i < length(includeFileNames); ++i)
+    {
+        if (!readWhitelist(wlBarcodes, includeFileNames[i], wlBarcodes.numLists, numThreads))
+            return false;
+        (requireAll ? wlBarcodes.includeAll : wlBarcodes.includeAny) |= 1u << wlBarcodes.numLists++;
+    }
+    for (unsigned i = 0; i < length(excludeFileNames); ++i)
+    {
+        if (!readWhitelist(wlBarcodes, excludeFileNames[i], wlBarcodes.numLists, numThreads))
+            return false;
+        wlBarcodes.exclude |= 1u << wlBarcodes.numLists++;
+    }
+    packWhitelist(wlBarcodes);
+    return true;
+}
+
+#endif /* WHITELIST_H_ */
@@ -5,21 +5,28 @@
 #include <seqan/bam_io.h>
 #include "argparse.h"
 #include "bamsubset.h"
+#include "blocksample.h"
+#include "counts.h"
+#include "dedup.h"
+#include "merge.h"
+#include "reservoir.h"
+#include "split.h"
+#include <iomanip>
 #include <iostream>
 
 using namespace seqan;
 
 //Checking parameters given by user
-int parseBCSubsetParams(Parameters & params, std::unordered_set<std::string> & wlBarcodes, int argc, char const * argv[])
+int parseBCSubsetParams(Parameters & params, Whitelist & wlBarcodes, int argc, char const * argv[])
 {
     if(parseCommandLine(params, argc, argv) != ArgumentParser::PARSE_OK)
     {
         std::cerr << "ERROR: Could not parse command line\n";
         return 1;
     }
-    if (params.bcWlFileName == "")
+    if (empty(params.bcWlFileNames) && empty(params.bcExcludeFileNames))
     {
-        std::cerr << "ERROR: whitelist file not specified. Please use option -f\n";
+        std::cerr << "ERROR: whitelist file not specified. Please use option -w or -x\n";
         return 1;
     }
     if (params.outBamFileName == "")
@@ -27,14 +34,78 @@ int parseBCSubsetParams(Parameters & params, std::unordered_set<std::string> & w
         std::cerr << "ERROR: Output file not specified. Please use option -o\n";
         return 1;
     }
-    if(!readWhitelist(wlBarcodes, params.bcWlFileName))
+    if(!readWhitelists(wlBarcodes, params.bcWlFileNames, params.bcExcludeFileNames, params.requireAllLists,
+                       params.threads))
     {
-        std::cerr << "ERROR: Could not read " << params.bcWlFileName << "\n";
+        std::cerr << "ERROR: Could not read barcode lists\n";
         return 1;
     }
     return 0;
 }
 
+// Output format from --output_fmt or the output file name
+inline OutputType getOutputType(const Parameters & params)
+{
+    CharString const & name = params.outBamFileName;
+    if (params.outputFormat == "sam")
+        return OUTPUT_SAM;
+    if (params.outputFormat == "fastq")
+        return OUTPUT_FASTQ;
+    if (!empty(params.outputFormat))
+        return OUTPUT_BAM;
+    if (endsWith(name, ".sam") || endsWith(name, ".sam.gz"))
+        return OUTPUT_SAM;
+    if (endsWith(name, ".fastq") || endsWith(name, ".fastq.gz") || endsWith(name, ".fq") || endsWith(name, ".fq.gz"))
+        return OUTPUT_FASTQ;
+    return OUTPUT_BAM;
+}
+
+// Name of a barcode list file without directory and extension
+inline CharString listName(CharString const & fileName)
+{
+    size_t begin = length(fileName);
+    while (begin > 0 && fileName[begin - 1] != '/')
+        --begin;
+    size_t end = length(fileName);
+    for (size_t i = begin + 1; i < length(fileName); ++i)
+        if (fileName[i] == '.')
+            end = i;
+    return infix(fileName, begin, end);
+}
+
+// Open the FASTQ files for read 1, read 2 and singletons, for each include list with --split_fastq
+inline bool openFastqOutput(RecordOutput & output, const Parameters & params)
+{
+    if (params.splitFastq && empty(params.bcWlFileNames))
+    {
+        std::cerr << "ERROR: --split_fastq needs barcode lists given by -w.\n";
+        return false;
+    }
+    output.pairedFastq = !empty(params.fastqR2FileName);
+    output.singletonFastq = !empty(params.fastqSingletonFileName);
+
+    unsigned numGroups = params.splitFastq ? length(params.bcWlFileNames) : 1;
+    for (unsigned g = 0; g < numGroups; ++g)
+    {
+        CharString fileName = params.outBamFileName;
+        CharString r2FileName = params.fastqR2FileName;
+        CharString singletonFileName = params.fastqSingletonFileName;
+        if (params.splitFastq)
+        {
+            fileName = groupFileName(fileName, listName(params.bcWlFileNames[g]));
+            r2FileName = groupFileName(r2FileName, listName(params.bcWlFileNames[g]));
+            singletonFileName = groupFileName(singletonFileName, listName(params.bcWlFileNames[g]));
+        }
+        if (!openFastqFile(output.fastq, fileName, params.checksum))
+            return false;
+        if (output.pairedFastq && !openFastqFile(output.fastq, r2FileName, params.checksum))
+            return false;
+        if (output.singletonFastq && !openFastqFile(output.fastq, singletonFileName, params.checksum))
+            return false;
+    }
+    return true;
+}
+
 // Generate BAM subset of reads with whitelisted barcodes
 int bamSubset(int argc, char const * argv[])
 {
@@ -44,38 +115,380 @@ int bamSubset(int argc, char const * argv[])
     if (res >= 0)
         return res;
 
-    std::unordered_set<std::string> wlBarcodes;
+    BarcodeSpec bcSpec;
+    if (!parseBarcodeSpec(bcSpec, params.bctag, params.trimming))
+        return 1;
 
-    readWhitelist(wlBarcodes, params.bcWlFileName);
+    TagEdits tagEdits;
+    if (!parseTagEdits(tagEdits, params.keepTags, params.dropTags, params.addTags))
+        return 1;
+    // Counted records are not written, their tags stay as they are
+    if (params.countOnly)
+        tagEdits = TagEdits();
+    if (params.sampleBlocks != 0 && !params.countOnly)
+    {
+        std::cerr << "ERROR: --sample_blocks is only used with --count_only.\n";
+        return 1;
+    }
+    if (params.sampleBlocks != 0 && (params.bamFileName == "-" || length(params.bamFileNames) > 1 ||
+                                     params.mateConsistent || !empty(params.split)))
+    {
+        std::cerr << "ERROR: --sample_blocks needs a single BAM file as input and cannot be combined with -m or --split.\n";
+        return 1;
+    }
+    if (!empty(params.dedup) && (params.mateConsistent || !empty(params.split) || params.sampleBlocks != 0))
+    {
+        std::cerr << "ERROR: --dedup cannot be combined with -m, --split or --sample_blocks.\n";
+        return 1;
+    }
+    if (params.readsPerBarcode != 0 && (params.mateConsistent || !empty(params.split) || params.sampleBlocks != 0 ||
+                                        !empty(params.dedup)))
+    {
+        std::cerr << "ERROR: --reads_per_barcode cannot be combined with -m, --split, --sample_blocks or --dedup.\n";
+        return 1;
+    }
+    // Barcodes missing from the whitelist table are named from the written records to order the sample
+    if (params.readsPerBarcode != 0 && params.sampleOrder == "barcode" && empty(params.bcWlFileNames))
+    {
+        for (unsigned c = 0; c < bcSpec.numComponents; ++c)
+            for (unsigned t = 0; t < bcSpec.components[c].numTags; ++t)
+                if (!keepsTag(tagEdits, tagKey(bcSpec.components[c].tags[t].key)))
+                {
+                    std::cerr << "ERROR: --sample_order barcode needs -w when the barcode tags are removed.\n";
+                    return 1;
+                }
+    }
+    if (!empty(params.dedup) && length(params.umiTag) != 2)
+    {
+        std::cerr << "ERROR: Invalid UMI tag " << params.umiTag << ".\n";
+        return 1;
+    }
 
-    // Open BamFileIn for reading
+    if (empty(params.bcWlFileNames) && empty(params.bcExcludeFileNames))
+    {
+        std::cerr << "ERROR: whitelist file not specified. Please use option -w or -x\n";
+        return 1;
+    }
+    if ((params.countOnly || getOutputType(params) != OUTPUT_FASTQ) &&
+        (params.splitFastq || !empty(params.fastqR2FileName) || !empty(params.fastqSingletonFileName)))
+    {
+        std::cerr << "ERROR: --fastq_r2, --fastq_singletons and --split_fastq are only used for FASTQ output.\n";
+        return 1;
+    }
+
+    // Part of the input with --split, found by seeking in the compressed file
+    SplitSpec split;
+    if (!empty(params.split))
+    {
+        if (!parseSplitSpec(split, params.split))
+            return 1;
+        if (params.bamFileName == "-" || length(params.bamFileNames) > 1)
+        {
+            std::cerr << "ERROR: --split needs a single BAM file as input.\n";
+            return 1;
+        }
+    }
+
+    Whitelist wlBarcodes;
+    wlBarcodes.numComponents = bcSpec.numComponents;
+    if (!readWhitelists(wlBarcodes, params.bcWlFileNames, params.bcExcludeFileNames, params.requireAllLists,
+                        params.threads))
+        return 1;
+    if (wlBarcodes.labels.size() > 1 && !params.countOnly)
+    {
+        if (!setLabelTags(tagEdits, params.labelTag, wlBarcodes.labels))
+            return 1;
+        std::cout << "[bcsubset] Tagging the records with " << wlBarcodes.labels.size() - 1 << " barcode labels as "
+                  << params.labelTag << "." << std::endl;
+    }
+
+    // Open BamFileIn for reading, BAM or SAM, '-' reads from stdin
     BamFileIn inFile;
-    if (!open(inFile, toCString(params.bamFileName)))
+    if (!open(inFile, (params.bamFileName == "-") ? "/dev/stdin" : toCString(params.bamFileName)))
     {
         std::cerr << "ERROR: Could not open " << params.bamFileName << " for reading.\n";
         return 1;
     }
 
-    // Open output file BamFileOut
-    std::fstream outStream;
-    outStream.open(toCString(params.outBamFileName), std::ios::out);
-    if (!outStream.good())
-        SEQAN_THROW(FileOpenError(toCString(params.outBamFileName)));
-    
-    BamFileOut bamFileOut(context(inFile), outStream, Bam());
+    // Open output file BamFileOut, or the FASTQ files
+    // SAM and FASTQ output is BGZF compressed for .gz file names
+    // With --count_only, nothing is opened, the output file gets the counts per barcode at the end
+    RecordOutput output;
+    output.type = params.countOnly ? OUTPUT_NONE : getOutputType(params);
+    output.contigNames = &contigNames(context(inFile));
+    Md5OutStream outStream;
+    BamFileOut bamFileOut(context(inFile));
+    if (output.type == OUTPUT_FASTQ)
+    {
+        if (!openFastqOutput(output, params))
+            return 1;
+    }
+    else if (output.type != OUTPUT_NONE)
+    {
+        outStream.open(toCString(params.outBamFileName), params.checksum);
+        if (!outStream.good())
+            SEQAN_THROW(FileOpenError(toCString(params.outBamFileName)));
+        output.bamFileOut = &bamFileOut;
+        if (output.type == OUTPUT_BAM)
+            open(bamFileOut, outStream, Bam());
+        else
+        {
+            setFormat(bamFileOut, Sam());
+            if (endsWith(params.outBamFileName, ".gz"))
+                _open(bamFileOut, outStream, BgzfFile(), False());
+            else
+                _open(bamFileOut, outStream, Nothing(), False());
+        }
+    }
 
     // Access header
     BamHeader header;
     readHeader(header, inFile);
 
+    // SAM records are parsed by the filter threads
+    bool samInput = isEqual(format(inFile), Sam());
+    SamParser samParser;
+    if (samInput)
+        initSamParser(samParser, contigNames(context(inFile)));
+    if (samInput && split.count != 0)
+    {
+        std::cerr << "ERROR: --split needs a single BAM file as input.\n";
+        return 1;
+    }
+    if (samInput && params.sampleBlocks != 0)
+    {
+        std::cerr << "ERROR: --sample_blocks needs a single BAM file as input and cannot be combined with -m or --split.\n";
+        return 1;
+    }
+
+    // Further BAM files share the references of the first one, their references and read groups are added
+    // to its header. The reference IDs of their records are translated when they are read.
+    std::vector<std::unique_ptr<BamFileIn> > moreInFiles;
+    std::vector<BamFileIn *> inFiles(1, &inFile);
+    std::vector<String<unsigned> > translations(1, context(inFile).translateFile2GlobalRefId);
+    for (unsigned i = 1; i < length(params.bamFileNames); ++i)
+    {
+        moreInFiles.emplace_back(new BamFileIn(context(inFile)));
+        BamFileIn & moreInFile = *moreInFiles.back();
+        if (!open(moreInFile, toCString(params.bamFileNames[i])))
+        {
+            std::cerr << "ERROR: Could not open " << params.bamFileNames[i] << " for reading.\n";
+            return 1;
+        }
+        if (samInput || !isEqual(format(moreInFile), Bam()))
+        {
+            std::cerr << "ERROR: Several inputs must all be BAM files.\n";
+            return 1;
+        }
+        size_t numKnownRefs = length(contigNames(context(inFile)));
+        String<int32_t> knownLengths = contigLengths(context(inFile));
+        BamHeader moreHeader;
+        readHeader(moreHeader, moreInFile);
+        translations.push_back(context(moreInFile).translateFile2GlobalRefId);
+        if (!checkRefLengths(translations.back(), knownLengths, contigLengths(context(inFile)),
+                             contigNames(context(inFile)), params.bamFileNames[i]))
+            return 1;
+        if (params.sorted && !checkRefOrder(translations.back(), contigNames(context(inFile)), params.bamFileNames[i]))
+            return 1;
+        mergeBamHeader(header, moreHeader, numKnownRefs, contigNames(context(inFile)));
+        inFiles.push_back(&moreInFile);
+    }
+    if (inFiles.size() > 1 && !params.sorted)
+        clearSortOrder(header);
+
+    // Restrict to regions, using the index if there is one
+    RecordPredicate predicate;
+    BamIndex<Bai> baiIndex;
+    bool indexed = false;
+    if (!empty(params.regionsFileName))
+    {
+        if (!readRegions(predicate.regions, params.regionsFileName, contigNames(context(inFile))))
+            return 1;
+        CharString baiFileName = params.bamFileName;
+        append(baiFileName, ".bai");
+        indexed = !samInput && split.count == 0 && params.sampleBlocks == 0 && inFiles.size() == 1 &&
+                  open(baiIndex, toCString(baiFileName));
+        if (indexed)
+            std::cout << "[bcsubset] Reading the regions using the index '" << baiFileName << "'." << std::endl;
+        else
+            std::cout << "[bcsubset] No index '" << baiFileName << "' found, checking all records for the regions." << std::endl;
+    }
+
+    // FASTQ holds the primary alignment of each read only
+    if (output.type == OUTPUT_FASTQ)
+    {
+        PredicateOp op = PredicateOp();
+        op.code = PRED_FLAG_ANY;
+        op.negate = true;
+        op.value = BAM_FLAG_SECONDARY | BAM_FLAG_SUPPLEMENTARY;
+        predicate.ops.push_back(op);
+    }
+
+    if (!compileFilters(predicate, params.minMapq, params.requireFlags, params.excludeFlags, params.filterExpr,
+                        !empty(params.regionsFileName) && !indexed, contigNames(context(inFile))))
+        return 1;
+
+    // Records sampled by barcode are no longer sorted by coordinate
+    if (params.readsPerBarcode != 0 && params.sampleOrder == "barcode")
+        clearSortOrder(header);
+
     // Write header
-    processHeader(header, bamFileOut, argv);
+    if (output.type == OUTPUT_BAM || output.type == OUTPUT_SAM)
+        processHeader(header, bamFileOut, argv);
+    output.maxContigLength = maxContigLength(contigNames(context(inFile)));
 
-    processBam(inFile, bamFileOut, wlBarcodes, params.bctag, params.trimming, stats);
+    // Inputs sorted by barcode are joined with the sorted whitelist instead of hashing every barcode
+    bool barcodeSorted = inFiles.size() == 1 && isBarcodeSorted(header, bcSpec);
+    if (barcodeSorted)
+    {
+        sortWhitelist(wlBarcodes);
+        std::cout << "[bcsubset] Input is sorted by barcode, looking up the barcodes in order." << std::endl;
+    }
+    else if (params.bloom)
+    {
+        buildBloomFilter(wlBarcodes);
+    }
 
-    std::cout << "[bcsubset] Output file has been written to \'" << params.outBamFileName << "\'." << std::endl; 
+    BarcodeCounts counts(wlBarcodes, bcSpec);
+    output.counts = &counts;
+    output.checksum = params.checksum;
+    FlagStats flagStats;
+    if (params.flagstat)
+        output.flagStats = &flagStats;
+    // Duplicates are found among the records at the same position, the input must be sorted by coordinate
+    DuplicateMarker duplicates(toCString(params.umiTag), params.dedup == "remove");
+    if (!empty(params.dedup))
+    {
+        if (!isCoordinateSorted(header))
+        {
+            std::cerr << "ERROR: --dedup needs an input sorted by coordinate (SO:coordinate in the header, "
+                      << "and --sorted for several inputs).\n";
+            return 1;
+        }
+        output.duplicates = &duplicates;
+        std::cout << "[bcsubset] " << (duplicates.remove ? "Removing" : "Marking") << " duplicates by position, "
+                  << "barcode and " << params.umiTag << " UMI." << std::endl;
+    }
+    ReservoirSample sample(wlBarcodes, bcSpec, params.readsPerBarcode, params.sampleSeed,
+                           params.sampleOrder == "barcode", static_cast<size_t>(params.sampleMemory) << 20);
+    if (params.readsPerBarcode != 0)
+    {
+        output.sample = &sample;
+        std::cout << "[bcsubset] Sampling " << params.readsPerBarcode << " records per barcode." << std::endl;
+    }
+    BarcodeFilter filter{wlBarcodes, bcSpec, predicate, params.mateConsistent, samInput ? &samParser : NULL,
+                         params.splitFastq, barcodeSorted, tagEdits, output.duplicates,
+                         output.sample};
+    bool nameGrouped = inFiles.size() == 1 && isNameGrouped(header);
+    if (params.mateConsistent && nameGrouped)
+        std::cout << "[bcsubset] Input is grouped by read name, resolving mates per read name." << std::endl;
+    // The reads of a pair are written together, adjacent mates only need to be held until the read name changes
+    output.nameGrouped = nameGrouped && !(params.readsPerBarcode != 0 && params.sampleOrder == "barcode");
+
+    uint64_t sampledBlocks = 0;
+    uint64_t numBlocks = 0;
+    if (params.sampleBlocks != 0)
+    {
+        BlockSampleReader reader;
+        if (!openBlockSample(reader, params.bamFileName, position(inFile), params.sampleBlocks,
+                             length(contigNames(context(inFile)))))
+            return 1;
+        std::cout << "[bcsubset] Counting the records of every " << params.sampleBlocks << ". block of the input."
+                  << std::endl;
+        processBam(reader, output, filter, params.threads, nameGrouped, params.mateWindow, stats);
+        sampledBlocks = reader.sampledBlocks;
+        numBlocks = reader.numBlocks;
+    }
+    else if (split.count != 0)
+    {
+        uint64_t begin = 0;
+        uint64_t end = SPLIT_END;
+        if (!findSplitRange(begin, end, params.bamFileName, position(inFile), split,
+                            length(contigNames(context(inFile)))))
+            return 1;
+        std::cout << "[bcsubset] Processing part " << split.index << "/" << split.count << " of the input."
+                  << std::endl;
+        setPosition(inFile, begin);
+        SplitReader reader{inFile, end};
+        processBam(reader, output, filter, params.threads, nameGrouped, params.mateWindow, stats);
+    }
+    else if (inFiles.size() > 1 && params.sorted)
+    {
+        std::cout << "[bcsubset] Merging the records of " << inFiles.size() << " input files by coordinate."
+                  << std::endl;
+        SortedMergeReader reader;
+        reader.keepAll = params.mateConsistent;
+        startMerge(reader, inFiles, translations, filter);
+        MergedFilter mergedFilter{params.mateConsistent};
+        processBam(reader, output, mergedFilter, params.threads, nameGrouped, params.mateWindow, stats);
+    }
+    else if (inFiles.size() > 1)
+    {
+        std::cout << "[bcsubset] Reading " << inFiles.size() << " input files in turns." << std::endl;
+        RoundRobinReader reader{inFiles, translations, 0};
+        processBam(reader, output, filter, params.threads, nameGrouped, params.mateWindow, stats);
+    }
+    else if (indexed)
+    {
+        RegionReader reader(inFile, baiIndex, predicate.regions);
+        processBam(reader, output, filter, params.threads, nameGrouped, params.mateWindow, stats);
+    }
+    else if (samInput)
+    {
+        SamReader reader{inFile, std::vector<char>()};
+        processBam(reader, output, filter, params.threads, nameGrouped, params.mateWindow, stats);
+    }
+    else
+    {
+        BamReader reader{inFile};
+        processBam(reader, output, filter, params.threads, nameGrouped, params.mateWindow, stats);
+    }
+
+    if (params.countOnly)
+    {
+        if (!writeBarcodeCounts(counts, params.outBamFileName))
+            return 1;
+    }
+    else
+    {
+        std::cout << "[bcsubset] Output file has been written to \'" << params.outBamFileName << "\'." << std::endl;
+    }
+    if (params.flagstat && !writeFlagStats(flagStats, params.outBamFileName, contigNames(context(inFile)),
+                                           contigLengths(context(inFile))))
+        return 1;
+    if (stats.unsortedBarcodes != 0)
+        std::cerr << "WARNING: The input is not sorted by barcode as stated in the header, "
+                  << stats.unsortedBarcodes << " records are out of order.\n";
+    if (stats.unsortedRecords != 0)
+        std::cerr << "WARNING: The input is not sorted by coordinate as expected, "
+                  << stats.unsortedRecords << " records are out of order.\n";
+    if (stats.singletonReads != 0 && !output.singletonFastq)
+        std::cerr << "WARNING: " << stats.singletonReads << " reads without a mate in the output were skipped, "
+                  << "they are written with --fastq_singletons.\n";
 
     stats.report();
+    if (params.sampleBlocks != 0)
+        reportSampleEstimate(counts, stats, sampledBlocks, numBlocks);
+
+    // The files are closed to hash their last blocks
+    if (params.checksum)
+    {
+        if (output.type == OUTPUT_BAM || output.type == OUTPUT_SAM)
+        {
+            close(bamFileOut);
+            outStream.close();
+            std::cout << "Output MD5:\t\t" << outStream.digest() << "  " << params.outBamFileName << std::endl;
+        }
+        for (unsigned i = 0; i < output.fastq.files.size(); ++i)
+        {
+            close(*output.fastq.files[i]);
+            output.fastq.streams[i]->close();
+            std::cout << "Output MD5:\t\t" << output.fastq.streams[i]->digest() << "  " << output.fastq.names[i]
+                      << std::endl;
+        }
+        std::cout << "Record checksum:\t" << std::hex << std::setw(16) << std::setfill('0') << stats.recordChecksum
+                  << std::dec << std::endl;
+    }
 
     return 0;
 }